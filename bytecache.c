@@ -0,0 +1,244 @@
+//
+// ByteCache.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Keeps the compiled (lua_dump'ed) bytecode of each script we load, keyed by path and modification
+// time, so reloading or switching back to a script we have already seen doesn't have to lex and
+// parse the source again. The cache always lives in memory; optionally it is also written to disk
+// next to the script (scripts/foo.lua -> scripts/foo.lua.cache), so it survives restarts.
+//
+// Usage:
+//	SetBytecodeDiskCache(true);						// optional
+//	if (LoadCachedLuaFile(L, "scripts/1.lua") == LUA_OK)	// works just like luaL_loadfile()
+//		lua_pcall(L, 0, LUA_MULTRET, 0);
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "lua/include/lauxlib.h"
+
+#include "bytecache.h"
+
+#define MAX_CACHED_SCRIPTS 32
+#define MAX_PATH_LENGTH 255
+#define DISK_CACHE_EXTENSION ".cache"
+#define DISK_CACHE_MAGIC "KPMLUAC1"
+
+typedef struct
+{
+	char path[MAX_PATH_LENGTH];
+	int64_t mtime;
+	int64_t size;
+	char *bytecode;
+	size_t length;
+} CachedScript;
+
+// header at the start of each on-disk cache file, followed by the bytecode itself
+typedef struct
+{
+	char magic[8];
+	int64_t mtime; // of the source file the bytecode was compiled from, in nanoseconds
+	int64_t size;
+} DiskCacheHeader;
+
+CachedScript cachedScripts[MAX_CACHED_SCRIPTS];
+int nextCacheSlot; // round robin replacement once the cache is full
+bool diskCacheEnabled = false;
+
+// scripts can be loaded from the console and from the file watcher at the same time
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// private routines
+CachedScript *FindCachedScript(const char *path, int64_t mtime, int64_t size);
+CachedScript *StoreCachedScript(const char *path, int64_t mtime, int64_t size, char *bytecode, size_t length);
+bool ReadDiskCache(const char *path, int64_t mtime, int64_t size, char **bytecode, size_t *length);
+void WriteDiskCache(const char *path, int64_t mtime, int64_t size, const char *bytecode, size_t length);
+int BytecodeWriter(lua_State *L, const void *p, size_t sz, void *ud);
+
+void SetBytecodeDiskCache(bool enabled)
+{
+	diskCacheEnabled = enabled;
+}
+
+CachedScript *FindCachedScript(const char *path, int64_t mtime, int64_t size)
+{
+	for (int i = 0; i < MAX_CACHED_SCRIPTS; i++)
+	{
+		CachedScript *c = &cachedScripts[i];
+		if (c->bytecode && c->mtime == mtime && c->size == size && strcmp(c->path, path) == 0)
+			return c;
+	}
+
+	return NULL;
+}
+
+// takes ownership of bytecode; replaces any older version of the same script
+CachedScript *StoreCachedScript(const char *path, int64_t mtime, int64_t size, char *bytecode, size_t length)
+{
+	CachedScript *c = NULL;
+
+	for (int i = 0; i < MAX_CACHED_SCRIPTS && !c; i++)
+	{
+		if (cachedScripts[i].bytecode && strcmp(cachedScripts[i].path, path) == 0)
+			c = &cachedScripts[i];
+	}
+
+	if (!c)
+	{
+		c = &cachedScripts[nextCacheSlot];
+		nextCacheSlot = (nextCacheSlot + 1) % MAX_CACHED_SCRIPTS;
+	}
+
+	free(c->bytecode);
+	strncpy(c->path, path, MAX_PATH_LENGTH - 1);
+	c->path[MAX_PATH_LENGTH - 1] = 0;
+	c->mtime = mtime;
+	c->size = size;
+	c->bytecode = bytecode;
+	c->length = length;
+
+	return c;
+}
+
+bool ReadDiskCache(const char *path, int64_t mtime, int64_t size, char **bytecode, size_t *length)
+{
+	char cachePath[MAX_PATH_LENGTH + sizeof(DISK_CACHE_EXTENSION)];
+	DiskCacheHeader header;
+	struct stat cacheStat;
+	FILE *file;
+
+	snprintf(cachePath, sizeof(cachePath), "%s%s", path, DISK_CACHE_EXTENSION);
+
+	if (stat(cachePath, &cacheStat) < 0 || cacheStat.st_size <= (off_t)sizeof(header))
+		return false;
+
+	file = fopen(cachePath, "rb");
+	if (!file)
+		return false;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, DISK_CACHE_MAGIC, 8) != 0 || header.mtime != mtime || header.size != size)
+	{
+		fclose(file);
+		return false;
+	}
+
+	*length = cacheStat.st_size - sizeof(header);
+	*bytecode = malloc(*length);
+	if (!*bytecode || fread(*bytecode, 1, *length, file) != *length)
+	{
+		free(*bytecode);
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+	return true;
+}
+
+void WriteDiskCache(const char *path, int64_t mtime, int64_t size, const char *bytecode, size_t length)
+{
+	char cachePath[MAX_PATH_LENGTH + sizeof(DISK_CACHE_EXTENSION)];
+	DiskCacheHeader header;
+	FILE *file;
+
+	snprintf(cachePath, sizeof(cachePath), "%s%s", path, DISK_CACHE_EXTENSION);
+
+	file = fopen(cachePath, "wb");
+	if (!file)
+	{
+		perror(cachePath);
+		return;
+	}
+
+	memcpy(header.magic, DISK_CACHE_MAGIC, 8);
+	header.mtime = mtime;
+	header.size = size;
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(bytecode, 1, length, file);
+	fclose(file);
+}
+
+// lua_Writer that appends to a growing buffer (ud points at the CachedScript being filled in)
+int BytecodeWriter(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	CachedScript *c = ud;
+	char *grown = realloc(c->bytecode, c->length + sz);
+
+	if (!grown)
+		return 1;
+
+	memcpy(grown + c->length, p, sz);
+	c->bytecode = grown;
+	c->length += sz;
+	return 0;
+}
+
+// loads the script as a function on top of the stack, just like luaL_loadfile(), but from cached bytecode
+// whenever the file hasn't changed since we last compiled it
+int LoadCachedLuaFile(lua_State *L, const char *filename)
+{
+	struct stat sourceStat;
+	int64_t mtime;
+	CachedScript *c;
+	CachedScript compiled;
+	char chunkname[MAX_PATH_LENGTH + 1];
+	int result;
+
+	if (stat(filename, &sourceStat) < 0)
+		return luaL_loadfile(L, filename); // let lua report the problem
+
+	// nanoseconds, so two saves within the same second still count as different versions
+	mtime = (int64_t)sourceStat.st_mtim.tv_sec * 1000000000 + sourceStat.st_mtim.tv_nsec;
+
+	snprintf(chunkname, sizeof(chunkname), "@%s", filename);
+
+	pthread_mutex_lock(&cacheLock);
+
+	c = FindCachedScript(filename, mtime, sourceStat.st_size);
+
+	if (!c && diskCacheEnabled)
+	{
+		char *bytecode;
+		size_t length;
+
+		if (ReadDiskCache(filename, mtime, sourceStat.st_size, &bytecode, &length))
+			c = StoreCachedScript(filename, mtime, sourceStat.st_size, bytecode, length);
+	}
+
+	if (c)
+	{
+		result = luaL_loadbufferx(L, c->bytecode, c->length, chunkname, "b");
+		pthread_mutex_unlock(&cacheLock);
+		return result;
+	}
+
+	pthread_mutex_unlock(&cacheLock);
+
+	// not cached (or the source changed); compile it, and keep the bytecode for next time
+	result = luaL_loadfile(L, filename);
+	if (result != LUA_OK)
+		return result;
+
+	memset(&compiled, 0, sizeof(compiled));
+	if (lua_dump(L, BytecodeWriter, &compiled, 0) != 0)
+	{
+		free(compiled.bytecode);
+		return result; // we still have a perfectly good function; it just won't be cached
+	}
+
+	if (diskCacheEnabled)
+		WriteDiskCache(filename, mtime, sourceStat.st_size, compiled.bytecode, compiled.length);
+
+	pthread_mutex_lock(&cacheLock);
+	StoreCachedScript(filename, mtime, sourceStat.st_size, compiled.bytecode, compiled.length);
+	pthread_mutex_unlock(&cacheLock);
+
+	return result;
+}
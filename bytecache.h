@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "lua/include/lua.h"
+
+void SetBytecodeDiskCache(bool enabled);
+int LoadCachedLuaFile(lua_State *L, const char *filename);
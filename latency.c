@@ -0,0 +1,94 @@
+//
+// Latency.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Very small latency histogram. Recording is cheap enough to do for every event from the MIDI
+// callback (no locks, no allocation); the percentiles are only estimates, since we only keep
+// one bucket per power of 2, but that is plenty to see where our time is going.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+// monotonic clock in microseconds, for timing things finer than portmidi's 1ms clock
+long long MicroTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// returns the bucket a latency falls into
+int LatencyBucket(int ms)
+{
+	int bucket = 0;
+
+	while (ms > 0 && bucket < LATENCY_BUCKETS - 1)
+	{
+		ms >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+void LatencyRecord(LatencyHistogram *h, int ms)
+{
+	// clocks can disagree by a tick; don't let that turn into a huge unsigned number
+	if (ms < 0)
+		ms = 0;
+
+	h->buckets[LatencyBucket(ms)]++;
+	h->count++;
+	if (ms > h->max)
+		h->max = ms;
+}
+
+void LatencyReset(LatencyHistogram *h)
+{
+	memset(h, 0, sizeof(LatencyHistogram));
+}
+
+// returns the upper bound (in ms) of the bucket containing the given percentile
+int LatencyPercentile(const LatencyHistogram *h, double percent)
+{
+	unsigned long target;
+	unsigned long seen = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (unsigned long)(h->count * percent / 100.0);
+	if (target >= h->count)
+		target = h->count - 1;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen > target)
+		{
+			int upper = (i == 0) ? 0 : (1 << i) - 1;
+			return (upper < h->max) ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+void LatencyPrint(const char *name, const LatencyHistogram *h, const char *unit)
+{
+	if (h->count == 0)
+		return;
+
+	printf("%-28s n=%-8lu p50<=%d%s  p99<=%d%s  p99.9<=%d%s  max=%d%s\n",
+		   name,
+		   h->count,
+		   LatencyPercentile(h, 50.0), unit,
+		   LatencyPercentile(h, 99.0), unit,
+		   LatencyPercentile(h, 99.9), unit,
+		   h->max, unit);
+}
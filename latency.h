@@ -0,0 +1,19 @@
+#pragma once
+
+// log-bucketed histogram of latencies, in whatever unit the caller records (milliseconds for MIDI events)
+// bucket 0 holds 0, bucket n holds [2^(n-1), 2^n)
+#define LATENCY_BUCKETS 17
+
+typedef struct
+{
+	unsigned long buckets[LATENCY_BUCKETS];
+	unsigned long count;
+	int max;
+} LatencyHistogram;
+
+void LatencyRecord(LatencyHistogram *h, int value);
+void LatencyReset(LatencyHistogram *h);
+int LatencyPercentile(const LatencyHistogram *h, double percent);
+void LatencyPrint(const char *name, const LatencyHistogram *h, const char *unit);
+
+long long MicroTime();
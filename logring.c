@@ -0,0 +1,170 @@
+//
+// LogRing.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Logging for the MIDI callback. The callback is not allowed to call printf() (if the terminal
+// blocks, then so would our MIDI output), so instead it drops small binary records into a
+// fixed-size lock-free ring, and a background thread formats and prints them.
+//
+// There is exactly one producer (the PortTime callback) and one consumer (the logging thread).
+// If the ring is full the record is thrown away and counted, so the callback never waits.
+//
+// Usage:
+//	InitLog();
+//	LogInts("input:  %d, %d, %d\n", status, data1, data2);		// from the callback
+//	KillLog();
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logring.h"
+
+#define LOG_RING_SIZE 1024 // must be a power of 2
+#define LOG_TEXT_MAX 96
+
+enum logRecordTypes
+{
+	LOG_RECORD_INTS,
+	LOG_RECORD_TEXT
+};
+
+typedef struct
+{
+	int type;
+	const char *format;
+	int args[3];
+	char text[LOG_TEXT_MAX];
+} LogRecord;
+
+LogRecord logRing[LOG_RING_SIZE];
+atomic_uint logHead; // next slot the callback writes to
+atomic_uint logTail; // next slot the logging thread reads from
+atomic_ulong logDropped;
+
+volatile bool log_running;
+pthread_t log_thread;
+
+// private routines
+LogRecord *BeginRecord();
+void CommitRecord();
+void *LogThreadProc(void *arg);
+
+void InitLog()
+{
+	atomic_store(&logHead, 0);
+	atomic_store(&logTail, 0);
+	atomic_store(&logDropped, 0);
+
+	log_running = true;
+	pthread_create(&log_thread, NULL, LogThreadProc, NULL);
+}
+
+void KillLog()
+{
+	if (log_running)
+	{
+		log_running = false;
+		pthread_join(log_thread, NULL);
+	}
+}
+
+void LogInts(const char *format, int a, int b, int c)
+{
+	LogRecord *rec = BeginRecord();
+	if (rec)
+	{
+		rec->type = LOG_RECORD_INTS;
+		rec->format = format;
+		rec->args[0] = a;
+		rec->args[1] = b;
+		rec->args[2] = c;
+		CommitRecord();
+	}
+}
+
+void LogText(const char *format, const char *text)
+{
+	LogRecord *rec = BeginRecord();
+	if (rec)
+	{
+		rec->type = LOG_RECORD_TEXT;
+		rec->format = format;
+		strncpy(rec->text, text ? text : "(null)", LOG_TEXT_MAX - 1);
+		rec->text[LOG_TEXT_MAX - 1] = 0;
+		CommitRecord();
+	}
+}
+
+unsigned long LogDroppedCount()
+{
+	return atomic_load(&logDropped);
+}
+
+// returns the slot to fill in, or NULL (and counts a drop) if the ring is full
+LogRecord *BeginRecord()
+{
+	unsigned int head = atomic_load_explicit(&logHead, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&logTail, memory_order_acquire);
+
+	if (head - tail >= LOG_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	return &logRing[head & (LOG_RING_SIZE - 1)];
+}
+
+// publishes the slot returned by BeginRecord() to the logging thread
+void CommitRecord()
+{
+	atomic_fetch_add_explicit(&logHead, 1, memory_order_release);
+}
+
+// drains the ring every few milliseconds, printing everything in it
+void *LogThreadProc(void *arg)
+{
+	unsigned long reportedDrops = 0;
+
+	while (1)
+	{
+		unsigned int tail = atomic_load_explicit(&logTail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&logHead, memory_order_acquire);
+
+		while (tail != head)
+		{
+			LogRecord *rec = &logRing[tail & (LOG_RING_SIZE - 1)];
+
+			if (rec->type == LOG_RECORD_INTS)
+				printf(rec->format, rec->args[0], rec->args[1], rec->args[2]);
+			else
+				printf(rec->format, rec->text);
+
+			tail++;
+			atomic_store_explicit(&logTail, tail, memory_order_release);
+		}
+
+		unsigned long drops = atomic_load(&logDropped);
+		if (drops != reportedDrops)
+		{
+			printf("[%lu log messages dropped]\n", drops - reportedDrops);
+			reportedDrops = drops;
+		}
+
+		fflush(stdout);
+
+		// make sure we print everything that was queued before we were asked to stop
+		if (!log_running && tail == atomic_load(&logHead))
+			break;
+
+		usleep(10000);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// printf() style format strings passed to these MUST be string literals;
+// they are only formatted later, on the logging thread
+void InitLog();
+void KillLog();
+void LogInts(const char *format, int a, int b, int c);
+void LogText(const char *format, const char *text);
+unsigned long LogDroppedCount();
@@ -0,0 +1,182 @@
+//
+// LuaPool.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Memory allocator for our lua interpreters. By default lua uses realloc(), which means any table or
+// string a script creates inside process_midi can end up in malloc on the MIDI thread. Instead, each
+// script gets one block of memory up front (touched, so it is really there), which is carved into
+// power-of-2 size classes with a free list for each.
+//
+// Anything too big for the largest class, or that doesn't fit once the pool is used up, falls back
+// to the system allocator; that is counted, so the pool can be sized for the scripts we actually run.
+//
+// Usage:
+//	pool = CreateLuaPool(1024 * 1024);
+//	L = lua_newstate(LuaPoolAlloc, pool);
+//	...
+//	lua_close(L);
+//	DestroyLuaPool(pool);
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luapool.h"
+
+#define LUA_POOL_MIN_BLOCK 16
+
+// private routines
+int PoolClass(size_t size);
+int InPool(const LuaPool *pool, const void *ptr);
+void *PoolMalloc(LuaPool *pool, size_t size);
+void PoolFree(LuaPool *pool, void *ptr, size_t size);
+
+LuaPool *CreateLuaPool(size_t capacity)
+{
+	LuaPool *pool = calloc(1, sizeof(LuaPool));
+
+	if (!pool)
+		return NULL;
+
+	pool->memory = malloc(capacity);
+	if (!pool->memory)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	// touch every page now, rather than taking page faults later while we are playing
+	memset(pool->memory, 0, capacity);
+	pool->capacity = capacity;
+
+	return pool;
+}
+
+void DestroyLuaPool(LuaPool *pool)
+{
+	if (pool)
+	{
+		free(pool->memory);
+		free(pool);
+	}
+}
+
+// returns the size class for a block of the given size, or -1 if it is too big for the pool
+int PoolClass(size_t size)
+{
+	int c = 0;
+	size_t block = LUA_POOL_MIN_BLOCK;
+
+	while (block < size)
+	{
+		block <<= 1;
+		if (++c == LUA_POOL_CLASSES)
+			return -1;
+	}
+
+	return c;
+}
+
+int InPool(const LuaPool *pool, const void *ptr)
+{
+	return (const char *)ptr >= pool->memory && (const char *)ptr < pool->memory + pool->capacity;
+}
+
+void *PoolMalloc(LuaPool *pool, size_t size)
+{
+	int c = PoolClass(size);
+	void *ptr = NULL;
+
+	if (c >= 0)
+	{
+		size_t block = (size_t)LUA_POOL_MIN_BLOCK << c;
+
+		if (pool->freeLists[c])
+		{
+			ptr = pool->freeLists[c];
+			pool->freeLists[c] = *(void **)ptr;
+		}
+		else if (pool->used + block <= pool->capacity)
+		{
+			ptr = pool->memory + pool->used;
+			pool->used += block;
+		}
+	}
+
+	if (!ptr)
+	{
+		pool->exhausted++;
+		ptr = malloc(size);
+		if (!ptr)
+			return NULL;
+	}
+
+	pool->allocations++;
+	pool->bytesInUse += size;
+	if (pool->bytesInUse > pool->peakBytes)
+		pool->peakBytes = pool->bytesInUse;
+
+	return ptr;
+}
+
+void PoolFree(LuaPool *pool, void *ptr, size_t size)
+{
+	pool->bytesInUse -= size;
+
+	if (InPool(pool, ptr))
+	{
+		int c = PoolClass(size);
+		*(void **)ptr = pool->freeLists[c];
+		pool->freeLists[c] = ptr;
+	}
+	else
+		free(ptr);
+}
+
+// lua_Alloc compatible allocator; ud is the LuaPool
+// (when ptr is not NULL, lua always tells us the size it originally asked for in osize,
+// which is how we know which size class a block belongs to)
+void *LuaPoolAlloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	LuaPool *pool = ud;
+	void *newptr;
+
+	if (nsize == 0)
+	{
+		if (ptr)
+			PoolFree(pool, ptr, osize);
+		return NULL;
+	}
+
+	if (!ptr)
+		return PoolMalloc(pool, nsize);
+
+	// still fits in the block we already have?
+	if (InPool(pool, ptr) && PoolClass(nsize) == PoolClass(osize))
+	{
+		pool->bytesInUse += nsize;
+		pool->bytesInUse -= osize;
+		if (pool->bytesInUse > pool->peakBytes)
+			pool->peakBytes = pool->bytesInUse;
+		return ptr;
+	}
+
+	newptr = PoolMalloc(pool, nsize);
+	if (!newptr)
+		return NULL;
+
+	memcpy(newptr, ptr, osize < nsize ? osize : nsize);
+	PoolFree(pool, ptr, osize);
+
+	return newptr;
+}
+
+void PrintLuaPoolStatistics(const LuaPool *pool)
+{
+	printf("lua pool size:              %lu KB (%lu KB carved into blocks)\n", (unsigned long)pool->capacity / 1024, (unsigned long)pool->used / 1024);
+	printf("lua allocations:            %lu\n", pool->allocations);
+	printf("lua bytes in use:           %lu (peak %lu)\n", pool->bytesInUse, pool->peakBytes);
+	printf("lua pool exhausted:         %lu times\n", pool->exhausted);
+}
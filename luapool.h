@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+// number of size classes; block sizes are 16, 32, 64 ... 16 << (LUA_POOL_CLASSES - 1) bytes
+#define LUA_POOL_CLASSES 9
+
+// preallocated, size-classed memory for one lua_State
+typedef struct
+{
+	char *memory;
+	size_t capacity;
+	size_t used; // how much of memory has been carved up into blocks so far
+	void *freeLists[LUA_POOL_CLASSES];
+
+	// statistics
+	unsigned long allocations;
+	unsigned long bytesInUse;
+	unsigned long peakBytes;
+	unsigned long exhausted; // requests we had to hand off to the system allocator
+} LuaPool;
+
+LuaPool *CreateLuaPool(size_t capacity);
+void DestroyLuaPool(LuaPool *pool);
+void *LuaPoolAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+void PrintLuaPoolStatistics(const LuaPool *pool);
@@ -0,0 +1,866 @@
+//
+// LuaScript.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Loading and running the user's .Lua scripts.
+//
+// Scripts are compiled into a brand new lua_State on whatever thread asks for them (never the MIDI
+// callback, since that means file I/O and compiling), and then handed over to the callback with an
+// atomic pointer swap. The old state is only closed once we know the callback has stopped using it,
+// so the callback never has a state closed out from under it in the middle of lua_pcall().
+//
+// Usage:
+//	(main thread)
+//	script = CompileLuaScript("scripts/1.lua");
+//	if (script)
+//		PublishLuaScript(script);		// retires (and frees) whatever was loaded before
+//
+//	(callback)
+//	script = AcquireLuaScript();
+//	if (script)
+//		CallLuaProcessMidi(script, &event);
+//	ReleaseLuaScript();
+//
+// Several scripts can be chained together with CompileLuaPipeline(); the callback runs each stage
+// in turn (following script->next), and the whole pipeline is published and freed as one.
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lua/include/lualib.h"
+#include "lua/include/lauxlib.h"
+
+#include "luascript.h"
+#include "logring.h"
+#include "latency.h"
+#include "bytecache.h"
+#include "scheduler.h"
+#include "tempotrack.h"
+#include "portmidi/porttime.h"
+
+_Atomic(LuaScript *) activeScript; // the script the callback should be using
+atomic_bool luaBusy;			   // TRUE while the callback is between AcquireLuaScript() and ReleaseLuaScript()
+atomic_uint luaGeneration;		   // bumped each time the callback calls ReleaseLuaScript()
+
+// only one thread at a time gets to swap scripts
+pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;
+
+// size of the memory pool each script's interpreter gets; 0 means just use the system allocator
+size_t luaPoolSize = 1024 * 1024;
+
+// when TRUE, we stop lua's automatic garbage collector once a script is loaded, and the callback
+// collects in bounded steps with StepLuaGC() when it has time to spare
+bool scheduledGC = false;
+
+// garbage collection statistics (only written by the callback)
+unsigned long gcSteps;
+unsigned long gcCycles;
+long long gcTotalUs;
+long gcMaxUs;
+
+// every call into the script gets this long (per event) before we give up on it; 0 means no limit
+// a script that goes over LUA_MAX_OVERRUNS times is disabled, until it is loaded again
+#define LUA_MAX_OVERRUNS 3
+#define LUA_BUDGET_CHECK_INSTRUCTIONS 1000
+long luaBudgetUs = 2000;
+
+// deadline for the call in progress; these are per thread, since a script can be tabulated
+// (BuildPureMap) on a loading thread while the callback is busy running the one already loaded
+_Thread_local long long callDeadline;
+_Thread_local bool budgetExceeded;
+_Thread_local bool inCallbackCall; // TRUE only while the callback is inside a call into a script
+_Thread_local bool inLoaderCall;   // TRUE while BuildPureMap() is calling into a script
+unsigned long totalOverruns;
+
+// a pure script's answers are tabulated for every channel message status (0x80 - 0xEF) and data1;
+// data2 (velocity, controller value, ...) always passes straight through, which keeps the table small
+// (so it is quick to rebuild on every reload, and cheap to keep locked in memory under -m)
+// each (status, data1) is tried with these data2 values, to make sure the script really does that
+#define PURE_FIRST_STATUS 0x80
+#define PURE_LAST_STATUS 0xEF
+#define PURE_MAP_SIZE ((PURE_LAST_STATUS - PURE_FIRST_STATUS + 1) << 7)
+#define PURE_MAP_INDEX(status, data1) ((((status) - PURE_FIRST_STATUS) << 7) | (data1))
+static const int pureSampleData2[] = {1, 64, 127};
+
+// the whole tabulation gets this long, so a script that never returns can't hang whoever is loading it
+#define PURE_MAP_BUDGET_US 5000000
+
+// copy of the events handed to process_midi_buffer, so they can be put back if the call fails
+// (only used by the callback); must be at least as big as the most events the callback reads in a tick
+#define EVENT_BUFFER_BACKUP_SIZE 256
+PmEvent eventBufferBackup[EVENT_BUFFER_BACKUP_SIZE];
+
+// name of the metatable for our EventBuffer userdata
+#define EVENT_BUFFER_METATABLE "pianomirror.EventBuffer"
+
+// private routines
+bool BuildPureMap(LuaScript *script);
+void CreateEventBuffer(LuaScript *script);
+PmEvent *CheckEvent(lua_State *L);
+int EventBufferStatus(lua_State *L);
+int EventBufferData1(lua_State *L);
+int EventBufferData2(lua_State *L);
+int EventBufferTimestamp(lua_State *L);
+int EventBufferGet(lua_State *L);
+int EventBufferSet(lua_State *L);
+int EventBufferSetCount(lua_State *L);
+int EventBufferLength(lua_State *L);
+int ReferenceLuaFunction(lua_State *L, const char *name);
+int LuaPanic(lua_State *L);
+void LuaBudgetHook(lua_State *L, lua_Debug *ar);
+void BeginLuaCall(int events);
+void EndLuaCall(LuaScript *script, int result);
+int LuaEmitAt(lua_State *L);
+int LuaNow(lua_State *L);
+int LuaTempo(lua_State *L);
+
+void SetLuaPoolSize(size_t bytes)
+{
+	luaPoolSize = bytes;
+}
+
+void SetLuaScheduledGC(bool scheduled)
+{
+	scheduledGC = scheduled;
+}
+
+void SetLuaBudget(long microseconds)
+{
+	luaBudgetUs = microseconds;
+}
+
+// called every LUA_BUDGET_CHECK_INSTRUCTIONS instructions while a script runs;
+// if the call has used up its time, we abort it by raising an error
+// lua code also runs outside our lua_pcall()s (e.g. __gc finalizers during StepLuaGC()), where raising
+// an error would panic, so the hook does nothing unless we're inside a call from the callback
+// once the deadline has passed we keep raising the error, so a script can't pcall() its way past it
+void LuaBudgetHook(lua_State *L, lua_Debug *ar)
+{
+	if (!inCallbackCall && !inLoaderCall)
+		return;
+
+	if (budgetExceeded || MicroTime() > callDeadline)
+	{
+		budgetExceeded = true;
+		luaL_error(L, "time budget exceeded");
+	}
+}
+
+// starts the clock for a call that handles the given number of events
+void BeginLuaCall(int events)
+{
+	callDeadline = MicroTime() + luaBudgetUs * events;
+	budgetExceeded = false;
+	inCallbackCall = true;
+}
+
+// call this with the result of lua_pcall(); if the call ran out of time, count it, and turn the script
+// off if it keeps doing that (even if the script caught the error itself, and the call returned normally)
+void EndLuaCall(LuaScript *script, int result)
+{
+	inCallbackCall = false;
+
+	if (!budgetExceeded)
+		return;
+
+	totalOverruns++;
+	if (++script->overruns >= LUA_MAX_OVERRUNS)
+	{
+		script->disabled = true;
+		LogInts("lua script went over its time budget %d times; disabling it (reload to try again)\n", script->overruns, 0, 0);
+	}
+}
+
+// lua: emit_at(ms, status, data1, data2)
+// queues a message to go out at an absolute time (on the same clock as now()); returns false if the queue is full
+// only the callback owns the scheduler, so this can only be used from inside process_midi and friends
+int LuaEmitAt(lua_State *L)
+{
+	PmTimestamp when = (PmTimestamp)luaL_checkinteger(L, 1);
+	int status = (int)luaL_checkinteger(L, 2);
+	int data1 = (int)luaL_checkinteger(L, 3);
+	int data2 = (int)luaL_checkinteger(L, 4);
+
+	if (!inCallbackCall)
+		return luaL_error(L, "emit_at can only be called while handling MIDI events");
+
+	lua_pushboolean(L, ScheduleEvent(when, Pm_Message(status, data1, data2)));
+	return 1;
+}
+
+// lua: now()
+// returns the current time in milliseconds, on the same clock as the event timestamps
+int LuaNow(lua_State *L)
+{
+	lua_pushinteger(L, Pt_Time());
+	return 1;
+}
+
+// lua: tempo()
+// returns the tempo the player is playing at, in bpm (0 until we have heard enough notes)
+int LuaTempo(lua_State *L)
+{
+	lua_pushnumber(L, TrackedTempo());
+	return 1;
+}
+
+// same as the panic function luaL_newstate() would have given us
+int LuaPanic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
+// returns a registry reference to the named global function, or LUA_NOREF if the script doesn't define it
+int ReferenceLuaFunction(lua_State *L, const char *name)
+{
+	lua_getglobal(L, name);
+	if (lua_isfunction(L, -1))
+		return luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_pop(L, 1);
+	return LUA_NOREF;
+}
+
+// a script can declare that process_midi is a pure function by setting process_midi_pure = true;
+// the status and data1 it returns may only depend on the status and data1 it is given, and data2 has to
+// come back unchanged (so it can transpose or rechannel, but not change velocities)
+// in that case we call it for every possible (status, data1) right now, and from then on the callback
+// just looks the answer up, without ever calling into lua
+// returns false (after printing why) if the script didn't give us a sensible answer for everything
+// the budget hook must already be installed, so a script that never returns just fails here
+bool BuildPureMap(LuaScript *script)
+{
+	lua_State *L = script->L;
+	bool ok = true;
+
+	script->pureMap = malloc(PURE_MAP_SIZE * sizeof(PmMessage));
+	if (!script->pureMap)
+	{
+		printf("not enough memory to tabulate process_midi\n");
+		return false;
+	}
+
+	callDeadline = MicroTime() + PURE_MAP_BUDGET_US;
+	budgetExceeded = false;
+	inLoaderCall = true;
+
+	for (int status = PURE_FIRST_STATUS; status <= PURE_LAST_STATUS && ok; status++)
+	{
+		for (int data1 = 0; data1 < 128 && ok; data1++)
+		{
+			for (int i = 0; i < (int)(sizeof(pureSampleData2) / sizeof(pureSampleData2[0])) && ok; i++)
+			{
+				int data2 = pureSampleData2[i];
+
+				lua_rawgeti(L, LUA_REGISTRYINDEX, script->processMidiRef);
+				lua_pushinteger(L, status);
+				lua_pushinteger(L, data1);
+				lua_pushinteger(L, data2);
+
+				if (lua_pcall(L, 3, 3, 0) != 0 || !lua_isnumber(L, -3) || !lua_isnumber(L, -2) || !lua_isnumber(L, -1))
+				{
+					if (budgetExceeded)
+						printf("process_midi took too long to tabulate; not tabulating it\n");
+					else
+						printf("process_midi(%d, %d, %d) did not return 3 numbers; not tabulating it\n", status, data1, data2);
+					ok = false;
+				}
+				else
+				{
+					PmMessage answer = Pm_Message((int)lua_tointeger(L, -3), (int)lua_tointeger(L, -2), 0);
+					if (lua_tointeger(L, -1) != data2 || (i > 0 && answer != script->pureMap[PURE_MAP_INDEX(status, data1)]))
+					{
+						printf("process_midi(%d, %d, %d) depends on data2, or changes it; not tabulating it\n", status, data1, data2);
+						ok = false;
+					}
+					script->pureMap[PURE_MAP_INDEX(status, data1)] = answer;
+				}
+
+				lua_settop(L, 0);
+			}
+		}
+	}
+
+	inLoaderCall = false;
+
+	if (!ok)
+	{
+		free(script->pureMap);
+		script->pureMap = NULL;
+		return false;
+	}
+
+	// all that calling around probably left some garbage behind; clean it up now, not on the MIDI thread
+	lua_gc(L, LUA_GCCOLLECT, 0);
+
+	return true;
+}
+
+// replaces each channel message with the answer process_midi gave us for it at load time
+// (keeping its data2; anything else, like system messages, goes through untouched)
+void ApplyPureMap(LuaScript *script, PmEvent *events, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		int status = Pm_MessageStatus(events[i].message);
+
+		if (status >= PURE_FIRST_STATUS && status <= PURE_LAST_STATUS)
+		{
+			PmMessage answer = script->pureMap[PURE_MAP_INDEX(status, Pm_MessageData1(events[i].message))];
+			events[i].message = Pm_Message(Pm_MessageStatus(answer), Pm_MessageData1(answer), Pm_MessageData2(events[i].message));
+		}
+	}
+}
+
+// returns the event at index (argument 2, counting from 1) in the EventBuffer (argument 1)
+// raises a lua error if the index is out of range, or if the script hangs on to the buffer and
+// tries to use it outside of process_midi_buffer
+PmEvent *CheckEvent(lua_State *L)
+{
+	EventBuffer *buf = luaL_checkudata(L, 1, EVENT_BUFFER_METATABLE);
+	lua_Integer i = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, buf->events != NULL, 1, "event buffer can only be used inside process_midi_buffer");
+	luaL_argcheck(L, i >= 1 && i <= buf->count, 2, "event index out of range");
+
+	return &buf->events[i - 1];
+}
+
+// buf:status(i), buf:data1(i), buf:data2(i), buf:timestamp(i)
+int EventBufferStatus(lua_State *L)
+{
+	lua_pushinteger(L, Pm_MessageStatus(CheckEvent(L)->message));
+	return 1;
+}
+
+int EventBufferData1(lua_State *L)
+{
+	lua_pushinteger(L, Pm_MessageData1(CheckEvent(L)->message));
+	return 1;
+}
+
+int EventBufferData2(lua_State *L)
+{
+	lua_pushinteger(L, Pm_MessageData2(CheckEvent(L)->message));
+	return 1;
+}
+
+int EventBufferTimestamp(lua_State *L)
+{
+	lua_pushinteger(L, CheckEvent(L)->timestamp);
+	return 1;
+}
+
+// status, data1, data2 = buf:get(i)
+int EventBufferGet(lua_State *L)
+{
+	PmEvent *event = CheckEvent(L);
+	lua_pushinteger(L, Pm_MessageStatus(event->message));
+	lua_pushinteger(L, Pm_MessageData1(event->message));
+	lua_pushinteger(L, Pm_MessageData2(event->message));
+	return 3;
+}
+
+// buf:set(i, status, data1, data2)
+int EventBufferSet(lua_State *L)
+{
+	PmEvent *event = CheckEvent(L);
+	event->message = Pm_Message((int)luaL_checkinteger(L, 3), (int)luaL_checkinteger(L, 4), (int)luaL_checkinteger(L, 5));
+	return 0;
+}
+
+// buf:setcount(n) drops events off the end, or makes room for new ones (which start out as zeros,
+// stamped with the time of the last real event) up to the size of one tick
+// any slot the script doesn't fill in with buf:set() still has status 0, and is never sent
+int EventBufferSetCount(lua_State *L)
+{
+	EventBuffer *buf = luaL_checkudata(L, 1, EVENT_BUFFER_METATABLE);
+	lua_Integer n = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, buf->events != NULL, 1, "event buffer can only be used inside process_midi_buffer");
+	luaL_argcheck(L, n >= 0 && n <= buf->capacity, 2, "event count out of range");
+
+	for (int i = buf->count; i < n; i++)
+	{
+		buf->events[i].message = 0;
+		buf->events[i].timestamp = (buf->count > 0) ? buf->events[buf->count - 1].timestamp : 0;
+	}
+
+	buf->count = n;
+	return 0;
+}
+
+// #buf
+int EventBufferLength(lua_State *L)
+{
+	EventBuffer *buf = luaL_checkudata(L, 1, EVENT_BUFFER_METATABLE);
+	lua_pushinteger(L, buf->count);
+	return 1;
+}
+
+// makes the one EventBuffer userdata this script will ever need; each tick we just point it at that
+// tick's events, so calling process_midi_buffer never allocates anything
+void CreateEventBuffer(LuaScript *script)
+{
+	lua_State *L = script->L;
+	static const luaL_Reg methods[] = {
+		{"status", EventBufferStatus},
+		{"data1", EventBufferData1},
+		{"data2", EventBufferData2},
+		{"timestamp", EventBufferTimestamp},
+		{"get", EventBufferGet},
+		{"set", EventBufferSet},
+		{"setcount", EventBufferSetCount},
+		{NULL, NULL}};
+
+	script->eventBuffer = lua_newuserdata(L, sizeof(EventBuffer));
+	script->eventBuffer->events = NULL;
+	script->eventBuffer->count = 0;
+	script->eventBuffer->capacity = 0;
+
+	if (luaL_newmetatable(L, EVENT_BUFFER_METATABLE))
+	{
+		luaL_newlib(L, methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, EventBufferLength);
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+
+	script->eventBufferRef = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// builds a fresh lua environment and runs the script in it
+// process_midi (and process_midi_batch) are looked up once here and kept as registry references, so
+// the callback doesn't have to do a (string keyed) global lookup for every event
+// returns NULL (after printing why) if the script can't be loaded
+LuaScript *CompileLuaScript(const char *filename)
+{
+	LuaScript *script = calloc(1, sizeof(LuaScript));
+
+	if (!script)
+	{
+		printf("not enough memory to load %s\n", filename);
+		return NULL;
+	}
+
+	snprintf(script->filename, sizeof(script->filename), "%s", filename);
+
+	if (luaPoolSize)
+	{
+		script->pool = CreateLuaPool(luaPoolSize);
+		if (!script->pool)
+			printf("could not allocate %lu byte lua pool; using the system allocator\n", (unsigned long)luaPoolSize);
+	}
+
+	if (script->pool)
+	{
+		script->L = lua_newstate(LuaPoolAlloc, script->pool);
+		if (script->L)
+			lua_atpanic(script->L, LuaPanic);
+	}
+	else
+		script->L = luaL_newstate();
+	if (!script->L)
+	{
+		printf("not enough memory for a lua interpreter to load %s\n", filename);
+		FreeLuaScript(script);
+		return NULL;
+	}
+	luaL_openlibs(script->L);
+	lua_register(script->L, "emit_at", LuaEmitAt);
+	lua_register(script->L, "now", LuaNow);
+	lua_register(script->L, "tempo", LuaTempo);
+
+	// same as luaL_dofile(), except that the compiled bytecode is cached
+	if (LoadCachedLuaFile(script->L, filename) != LUA_OK || lua_pcall(script->L, 0, LUA_MULTRET, 0) != LUA_OK)
+	{
+		printf("error in .Lua script: %s\n", lua_tostring(script->L, -1));
+		FreeLuaScript(script);
+		return NULL;
+	}
+
+	script->processMidiRef = ReferenceLuaFunction(script->L, "process_midi");
+	script->processMidiBatchRef = ReferenceLuaFunction(script->L, "process_midi_batch");
+	script->processMidiBufferRef = ReferenceLuaFunction(script->L, "process_midi_buffer");
+
+	if (script->processMidiBufferRef != LUA_NOREF)
+		CreateEventBuffer(script);
+
+	// from now on, every call into this script is on the clock (tabulating it included)
+	lua_sethook(script->L, LuaBudgetHook, LUA_MASKCOUNT, LUA_BUDGET_CHECK_INSTRUCTIONS);
+
+	lua_getglobal(script->L, "process_midi_pure");
+	if (lua_toboolean(script->L, -1) && script->processMidiRef != LUA_NOREF)
+	{
+		lua_settop(script->L, 0);
+		if (BuildPureMap(script))
+			printf("process_midi is pure; tabulated it, so lua won't be called while playing\n");
+	}
+	lua_settop(script->L, 0);
+
+	if (luaBudgetUs <= 0)
+		lua_sethook(script->L, NULL, 0, 0);
+
+	// loading is done (and not on the MIDI thread), so from here on the callback decides when to collect
+	if (scheduledGC)
+		lua_gc(script->L, LUA_GCSTOP, 0);
+
+	if (!script->pureMap)
+	{
+		if (script->processMidiBufferRef != LUA_NOREF)
+			printf("using process_midi_buffer from loaded .Lua script\n");
+		else if (script->processMidiBatchRef != LUA_NOREF)
+			printf("using process_midi_batch from loaded .Lua script\n");
+		else if (script->processMidiRef == LUA_NOREF)
+			printf("no process_midi function defined in loaded .Lua script\n");
+	}
+
+	return script;
+}
+
+// compiles each of the files as one stage of a pipeline, in order
+// returns the first stage, or NULL if any of them failed to load (in which case none of them are kept)
+LuaScript *CompileLuaPipeline(char filenames[][255], int count)
+{
+	LuaScript *first = NULL;
+	LuaScript **link = &first;
+
+	for (int i = 0; i < count; i++)
+	{
+		*link = CompileLuaScript(filenames[i]);
+		if (!*link)
+		{
+			printf("could not load stage %d (%s) of the pipeline\n", i + 1, filenames[i]);
+			FreeLuaScript(first);
+			return NULL;
+		}
+		link = &(*link)->next;
+	}
+
+	return first;
+}
+
+// frees the script, along with any stages chained after it
+void FreeLuaScript(LuaScript *script)
+{
+	while (script)
+	{
+		LuaScript *next = script->next;
+
+		if (script->L)
+			lua_close(script->L);
+		DestroyLuaPool(script->pool);
+		free(script->pureMap);
+		free(script);
+
+		script = next;
+	}
+}
+
+// hands the script over to the callback (NULL means run without a script), then waits until the
+// callback is definitely finished with the previous one before freeing it
+void PublishLuaScript(LuaScript *script)
+{
+	LuaScript *old;
+	unsigned int generation;
+
+	pthread_mutex_lock(&publishLock);
+
+	old = atomic_exchange(&activeScript, script);
+
+	// if the callback is busy right now, it might have picked up the old script before we swapped;
+	// once it has released that, anything it acquires from now on will be the new one
+	generation = atomic_load(&luaGeneration);
+	while (atomic_load(&luaBusy) && atomic_load(&luaGeneration) == generation)
+		usleep(100);
+
+	FreeLuaScript(old);
+
+	pthread_mutex_unlock(&publishLock);
+}
+
+bool LuaScriptIsLoaded()
+{
+	return atomic_load(&activeScript) != NULL;
+}
+
+// prints how the currently loaded script is using its memory pool
+// (holding publishLock means the script can't be freed out from under us while we look at it)
+void ShowLuaMemoryStatistics()
+{
+	LuaScript *script;
+
+	pthread_mutex_lock(&publishLock);
+
+	script = atomic_load(&activeScript);
+	if (!script)
+		printf("no lua script loaded\n");
+
+	for (; script; script = script->next)
+	{
+		printf("%s:\n", script->filename);
+		if (!script->pool)
+			printf("lua script is using the system allocator\n");
+		else
+			PrintLuaPoolStatistics(script->pool);
+	}
+
+	pthread_mutex_unlock(&publishLock);
+
+	if (luaBudgetUs > 0)
+		printf("time budget overruns:       %lu (budget %ld us per event)\n", totalOverruns, luaBudgetUs);
+
+	if (scheduledGC)
+	{
+		printf("scheduled gc steps:         %lu (%lu full cycles)\n", gcSteps, gcCycles);
+		printf("gc time:                    %lld us total, %ld us max", gcTotalUs, gcMaxUs);
+		if (gcSteps)
+			printf(", %lld us average", gcTotalUs / gcSteps);
+		printf("\n");
+	}
+	else
+		printf("lua is using automatic garbage collection\n");
+}
+
+// prints how often each stage of the pipeline has been called, and how long it has taken
+void ShowLuaPipelineStatistics()
+{
+	LuaScript *script;
+	int stage = 1;
+
+	pthread_mutex_lock(&publishLock);
+
+	script = atomic_load(&activeScript);
+	if (!script)
+		printf("no lua script loaded\n");
+	else
+		printf("stage  calls       total us    avg us  peak us  script\n");
+
+	for (; script; script = script->next, stage++)
+	{
+		printf("%5d  %-10lu  %-10lld  %-6lld  %-7ld  %s%s\n", stage, script->calls, script->totalUs,
+			   script->calls ? script->totalUs / script->calls : 0, script->peakUs, script->filename,
+			   script->disabled ? " (disabled)" : "");
+	}
+
+	pthread_mutex_unlock(&publishLock);
+}
+
+// lends a whole tick's worth of events to the script's process_midi_buffer function as one userdata,
+// which reads and rewrites them in place (so no tables are made)
+// events must have room for maxCount entries; returns the new number of events
+// if the call fails (or runs out of time), the events go out untransformed, just as they came in
+int CallLuaProcessMidiBuffer(LuaScript *script, PmEvent *events, int count, int maxCount)
+{
+	lua_State *L = script->L;
+	EventBuffer *buf = script->eventBuffer;
+	int result;
+
+	if (count > EVENT_BUFFER_BACKUP_SIZE)
+	{
+		LogInts("too many events (%d) for process_midi_buffer; passing them through\n", count, 0, 0);
+		return count;
+	}
+	memcpy(eventBufferBackup, events, count * sizeof(PmEvent));
+
+	buf->events = events;
+	buf->count = count;
+	buf->capacity = maxCount;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->processMidiBufferRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->eventBufferRef);
+
+	BeginLuaCall(count);
+	result = lua_pcall(L, 1, 0, 0);
+	EndLuaCall(script, result);
+	if (result != LUA_OK)
+		LogText("error running function `process_midi_buffer': %s\n", lua_tostring(L, -1));
+	lua_settop(L, 0);
+
+	// make sure the script can't touch our stack memory after we return
+	buf->events = NULL;
+	// (a script that ran out of time but caught the error itself doesn't get to keep its changes either)
+	if (result == LUA_OK && !budgetExceeded)
+		count = buf->count;
+	else
+		memcpy(events, eventBufferBackup, count * sizeof(PmEvent));
+	buf->count = 0;
+
+	return count;
+}
+
+// does one bounded step of garbage collection, and keeps track of how long it took
+// returns TRUE if that step finished a collection cycle (so there is nothing left to do for now)
+bool StepLuaGC(LuaScript *script, int stepKB)
+{
+	long long start = MicroTime();
+	int finished = lua_gc(script->L, LUA_GCSTEP, stepKB);
+	long elapsed = (long)(MicroTime() - start);
+
+	gcSteps++;
+	gcTotalUs += elapsed;
+	if (elapsed > gcMaxUs)
+		gcMaxUs = elapsed;
+	if (finished)
+		gcCycles++;
+
+	return finished;
+}
+
+// how much memory (in KB) the script's lua state is using right now
+int LuaHeapKB(LuaScript *script)
+{
+	return lua_gc(script->L, LUA_GCCOUNT, 0);
+}
+
+// called once per tick for each stage that ran, with how long it took to process that tick's events
+void RecordLuaStageTime(LuaScript *stage, long elapsedUs)
+{
+	stage->calls++;
+	stage->totalUs += elapsedUs;
+	if (elapsedUs > stage->peakUs)
+		stage->peakUs = elapsedUs;
+}
+
+// returns TRUE if the script has anything for the callback to call (and hasn't been disabled)
+bool LuaScriptHasHandler(const LuaScript *script)
+{
+	return script && !script->disabled &&
+		   (script->pureMap || script->processMidiRef != LUA_NOREF || script->processMidiBatchRef != LUA_NOREF || script->processMidiBufferRef != LUA_NOREF);
+}
+
+// returns the script the callback should use for this tick (or NULL); must be paired with ReleaseLuaScript()
+LuaScript *AcquireLuaScript()
+{
+	atomic_store(&luaBusy, true);
+	return atomic_load(&activeScript);
+}
+
+void ReleaseLuaScript()
+{
+	atomic_fetch_add(&luaGeneration, 1);
+	atomic_store(&luaBusy, false);
+}
+
+// runs one event through the script's process_midi function, replacing it with whatever the script returns
+void CallLuaProcessMidi(LuaScript *script, PmEvent *event)
+{
+	lua_State *L = script->L;
+	int status = Pm_MessageStatus(event->message);
+	int data1 = Pm_MessageData1(event->message);
+	int data2 = Pm_MessageData2(event->message);
+	int result;
+
+	// Push the process_midi function on the top of the lua stack
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->processMidiRef);
+
+	lua_pushnumber(L, status);
+	lua_pushnumber(L, data1);
+	lua_pushnumber(L, data2);
+
+	BeginLuaCall(1);
+	result = lua_pcall(L, 3, 3, 0);
+	EndLuaCall(script, result);
+	if (result == LUA_OK)
+	{
+
+		// Get the result from the lua stack
+		if ((lua_gettop(L) == 3 && lua_isnumber(L, -3) && lua_isnumber(L, -2) && lua_isnumber(L, -1)))
+		{
+			status = (int)lua_tointeger(L, -3);
+			data1 = (int)lua_tointeger(L, -2);
+			data2 = (int)lua_tointeger(L, -1);
+			event->message = Pm_Message(status, data1, data2);
+		}
+		else
+			LogText("%s", "function 'process_midi' must return 3 numbers\n");
+	}
+	else
+	{
+		// the event goes out just as it came in
+		LogText("error running function `process_midi': %s\n", lua_tostring(L, -1));
+	}
+
+	// Clean up.  If we don't do this last step, we'll leak stack memory.
+	lua_settop(L, 0); // discard anything returned, since we don't really know how many items were returned for sure
+}
+
+// hands a whole tick's worth of events to the script's process_midi_batch function in one call
+// the events go in as one flat table {status, data1, data2, status, data1, data2, ...} plus a count,
+// and the script returns a table laid out the same way (it can add, drop or change events)
+// events must have room for maxCount entries; returns the new number of events
+// if anything goes wrong, the events are left alone
+int CallLuaProcessMidiBatch(LuaScript *script, PmEvent *events, int count, int maxCount)
+{
+	lua_State *L = script->L;
+	PmTimestamp lastTimestamp = events[count - 1].timestamp;
+	int n, result;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->processMidiBatchRef);
+
+	lua_createtable(L, count * 3, 0);
+	for (int i = 0; i < count; i++)
+	{
+		lua_pushinteger(L, Pm_MessageStatus(events[i].message));
+		lua_rawseti(L, -2, i * 3 + 1);
+		lua_pushinteger(L, Pm_MessageData1(events[i].message));
+		lua_rawseti(L, -2, i * 3 + 2);
+		lua_pushinteger(L, Pm_MessageData2(events[i].message));
+		lua_rawseti(L, -2, i * 3 + 3);
+	}
+	lua_pushinteger(L, count);
+
+	BeginLuaCall(count);
+	result = lua_pcall(L, 2, 1, 0);
+	EndLuaCall(script, result);
+	if (result != LUA_OK)
+	{
+		LogText("error running function `process_midi_batch': %s\n", lua_tostring(L, -1));
+		lua_settop(L, 0);
+		return count;
+	}
+
+	if (!lua_istable(L, -1))
+	{
+		LogText("%s", "function 'process_midi_batch' must return a table\n");
+		lua_settop(L, 0);
+		return count;
+	}
+
+	n = lua_rawlen(L, -1) / 3;
+	if (n > maxCount)
+	{
+		LogInts("process_midi_batch returned %d events; only sending the first %d\n", n, maxCount, 0);
+		n = maxCount;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		int status, data1, data2;
+
+		lua_rawgeti(L, -1, i * 3 + 1);
+		lua_rawgeti(L, -2, i * 3 + 2);
+		lua_rawgeti(L, -3, i * 3 + 3);
+		status = (int)lua_tointeger(L, -3);
+		data1 = (int)lua_tointeger(L, -2);
+		data2 = (int)lua_tointeger(L, -1);
+		lua_pop(L, 3);
+
+		// any extra events the script made up are stamped with the time of the last real one
+		events[i].message = Pm_Message(status, data1, data2);
+		if (i >= count)
+			events[i].timestamp = lastTimestamp;
+	}
+
+	lua_settop(L, 0);
+	return n;
+}
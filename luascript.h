@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "lua/include/lua.h"
+#include "portmidi/portmidi.h"
+#include "luapool.h"
+
+// a tick's worth of events, lent to a script's process_midi_buffer function without copying them
+typedef struct
+{
+	PmEvent *events; // only valid during the call; NULL the rest of the time
+	int count;
+	int capacity;
+} EventBuffer;
+
+// one loaded script, with everything the callback needs to run it
+// scripts can be chained into a pipeline, where each stage's output is the next stage's input
+typedef struct LuaScript
+{
+	lua_State *L;
+	int processMidiRef;		 // registry reference to process_midi, or LUA_NOREF
+	int processMidiBatchRef; // registry reference to process_midi_batch, or LUA_NOREF
+	int processMidiBufferRef; // registry reference to process_midi_buffer, or LUA_NOREF
+	int eventBufferRef;		 // registry reference to the userdata holding eventBuffer (so it is never collected)
+	EventBuffer *eventBuffer;
+	LuaPool *pool;			 // where L gets its memory from, or NULL if it uses the system allocator
+	int overruns;			 // how many calls we have had to abort for going over the time budget
+	bool disabled;			 // set once the script has overrun too many times; the callback stops calling it
+	PmMessage *pureMap;		 // for scripts that declare process_midi_pure, process_midi's answer for every (status, data1)
+	struct LuaScript *next;	 // the next stage of the pipeline, or NULL if this is the last one
+	char filename[255];
+
+	// timing for this stage (only written by the callback)
+	unsigned long calls;
+	long long totalUs;
+	long peakUs;
+} LuaScript;
+
+// used from the main thread (or any thread other than the callback)
+LuaScript *CompileLuaScript(const char *filename);
+LuaScript *CompileLuaPipeline(char filenames[][255], int count);
+void FreeLuaScript(LuaScript *script);
+void PublishLuaScript(LuaScript *script);
+bool LuaScriptIsLoaded();
+void SetLuaPoolSize(size_t bytes);
+void ShowLuaMemoryStatistics();
+void ShowLuaPipelineStatistics();
+void SetLuaScheduledGC(bool scheduled);
+void SetLuaBudget(long microseconds);
+
+// used from the callback
+bool LuaScriptHasHandler(const LuaScript *script);
+LuaScript *AcquireLuaScript();
+void ReleaseLuaScript();
+void CallLuaProcessMidi(LuaScript *script, PmEvent *event);
+int CallLuaProcessMidiBatch(LuaScript *script, PmEvent *events, int count, int maxCount);
+int CallLuaProcessMidiBuffer(LuaScript *script, PmEvent *events, int count, int maxCount);
+bool StepLuaGC(LuaScript *script, int stepKB);
+int LuaHeapKB(LuaScript *script);
+void ApplyPureMap(LuaScript *script, PmEvent *events, int count);
+void RecordLuaStageTime(LuaScript *stage, long elapsedUs);
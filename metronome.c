@@ -1,129 +1,650 @@
-
 //
 // Metronome.c
 //
 // Benjamin Pritchard / Kundalini Software
 //
 // Routines for dealing with a metronome, adopted from code on the internet
-// This code uses the code in WAVE.C to actually play 'tick' sound on each beat
+// This code uses DoTick() to actually play the 'tick' sound on each beat
+//
+// The metronome runs on its own thread, which works a bar at a time: lookahead ms before each bar
+// starts, it works out every click in that bar (beats, subdivisions and swing, at the bar's tempo)
+// and queues the whole bar in one go. It sleeps between bars with clock_nanosleep(TIMER_ABSTIME);
+// every bar's start is the previous one's plus exactly its length in microseconds (bpm can be
+// fractional), and never depends on when we actually woke up, so the clicks don't drift however
+// long the metronome runs. A tempo map (e.g. +2 bpm every 8 bars) is applied between bars.
+//
+// The MIDI thread picks the queued clicks up in DoMetronome() (portmidi streams aren't thread safe)
+// and hands each one to DoTick() lookahead ms early, stamped with the time it should sound, and
+// portmidi (opened with a non-zero latency) sends it out at exactly that time.
+//
+// How late the thread wakes up for each bar, and how late the MIDI thread hands each click over, are
+// kept in histograms (ShowMetronomeStatistics()).
+//
+// The metronome can also drive other gear with MIDI clock (CLOCK_MASTER): each bar then carries
+// 24 clock pulses per beat (and a start message in front of the first bar), timestamped just like
+// the clicks. Or it can follow someone else's clock (CLOCK_SLAVE): the MIDI thread passes every
+// incoming clock message to ClockInput(), which runs a phase locked loop over the pulses to smooth
+// out their jitter, and plays each click one pulse ahead, stamped with when the loop expects it.
 //
 // Usage:
-//	InitMetronome()
-//	setBMP(180);
+//	setMetronomeLookahead(10);	// same as the output latency
+//	InitMetronome(wakeFd);		// after Pt_Start()
+//	setBeatsPerMinute(92.5);
 //	setBeatsPerMeasure(4);		// optional
+//	setSubdivisions(2, 0.67);	// optional; swung eighths
+//	setTempoMap(2, 8);			// optional; 2 bpm faster every 8 bars
+//	setClockMode(CLOCK_MASTER);	// optional (later on, only from the MIDI thread)
 //	EnableMetronome();
 //	While (1)
 //		DoMetronome
+//	KillMetronome();
 //
 //
 
 #include <stdbool.h>
-#include <signal.h>
-#include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include "portmidi/porttime.h"
 #include "metronome.h"
+#include "latency.h"
+
+// the main thread, the metronome thread (tempo map) and the MIDI thread (following the player, or
+// incoming MIDI clock) can all change the tempo, so it is atomic
+// the same goes for the rest of the settings: the metronome thread reads them while working out each
+// bar, and the main or MIDI thread can change them at any time (each bar takes a copy first)
+_Atomic double bpm;
+atomic_bool metronome_enabled;
+atomic_int measure;
+atomic_int beats_per_measure;
+
+// clicks per beat (1 = just the beats, 2 = eighths, 3 = triplets, 4 = sixteenths), and where the
+// off-beat of each pair lands, as a fraction of the pair (0.5 = straight, 0.67 = triplet swing)
+atomic_int subdivisions = 1;
+_Atomic double swing = 0.5;
+
+// tempo map: every tempoStepBars bars, bpm changes by tempoStepBpm (0 bars = fixed tempo)
+// while the metronome is following the player, the player sets the tempo, and the map is left alone
+_Atomic double tempoStepBpm = 0;
+atomic_int tempoStepBars = 0;
+atomic_bool tempoFollow;
+
+int lookahead; // how many ms before a click it is handed over to DoTick()
+
+// CLOCK_OFF, CLOCK_MASTER (send MIDI clock) or CLOCK_SLAVE (follow incoming MIDI clock)
+atomic_int clockMode = CLOCK_OFF;
+bool clockRunning = false; // TRUE once we have sent a start message, until we send stop (MIDI thread)
+
+// following MIDI clock (only touched by the MIDI thread, apart from slaveBpm)
+// the phase locked loop predicts when each pulse will arrive; every pulse, the prediction error nudges
+// the phase a little (PLL_PHASE_GAIN) and the pulse length a lot less (PLL_FREQUENCY_GAIN)
+#define PLL_PHASE_GAIN 0.1
+#define PLL_FREQUENCY_GAIN 0.01
+#define PLL_MAX_ERROR_PULSES 4 // further off than this and we assume the clock jumped; start locking again
+double slaveTickMs;			   // how long the loop thinks a pulse is; 0 until it has locked on
+double slaveNextTick;		   // when the loop expects the next pulse (portmidi time)
+PmTimestamp slaveLastTick;	   // when we got the first pulse (until we have locked on)
+bool slaveHaveTick = false;
+bool slaveRunning = false; // between start (or continue) and stop
+long slavePulse;		   // pulses since the last start
+unsigned long slaveRelocks;
+_Atomic double slaveBpm;
+
+pthread_t metronomeThread;
+bool metronomeThreadStarted = false;
+pthread_mutex_t metronomeLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metronomeChanged = PTHREAD_COND_INITIALIZER;
+bool metronomeQuit = false;
+bool metronomeRestart = false; // set by EnableMetronome(), so the thread starts counting again from now
+atomic_uint metronomeGeneration; // bumped by EnableMetronome(); clicks queued before that are stale
+int metronomeWakeFd = -1;	   // written to whenever a bar is queued, to wake up the MIDI thread
 
-int bpm;
-bool metronome_enabled;
-int timer_flag;
-int beat;
-int measure;
-int beats_per_measure;
+// clicks queued by the metronome thread for the MIDI thread (single producer, single consumer)
+// big enough for a whole bar (with clock), plus whatever is left of the bar before
+#define CLICK_QUEUE_SIZE 512
+
+typedef struct
+{
+	int level;			  // CLICK_DOWNBEAT, CLICK_BEAT, CLICK_SUBDIVISION or one of the CLOCK_ messages
+	PmTimestamp when;	  // portmidi time the click should sound
+	long long handOverUs; // when (on the MicroTime() clock) DoMetronome() should hand it over
+	unsigned generation;  // metronomeGeneration when the bar was worked out
+} Click;
+
+Click clickQueue[CLICK_QUEUE_SIZE];
+atomic_uint clickHead; // next slot the metronome thread writes
+atomic_uint clickTail; // next slot the MIDI thread reads
+
+// how late (in microseconds) the thread woke up for each bar; only written by the metronome thread
+LatencyHistogram wakeLateness;
+// how late (in microseconds) DoMetronome() handed each click over to DoTick(); only written by the MIDI thread
+LatencyHistogram clickLateness;
+unsigned long droppedClicks; // clicks that didn't fit in the queue (metronome thread)
+unsigned long lateClicks;	 // clicks that reached DoTick() after they should have sounded (MIDI thread)
 
 // private routines
-void DoTick(int);
-void MetronomeTimerProc();
+void DoTick(int level, PmTimestamp when);
+void *MetronomeThread(void *arg);
+int BuildBar(double beatUs, int beats, bool first, double *offsets, int *levels);
+int BeatsInBar();
+void SlaveClickForNextPulse();
+void QueueBar(double barStart, long long now, const double *offsets, const int *levels, int count, unsigned generation);
 
-void InitMetronome()
+// starts the metronome thread (which sleeps until the metronome is enabled)
+// wakeFd is an eventfd that gets written to every time a bar is queued (or -1)
+void InitMetronome(int wakeFd)
 {
-	bpm = 100;
-	timer_flag = 0;
+	if (bpm <= 0)
+		bpm = 100;
 	metronome_enabled = false;
 	measure = 0;
-	beat = 0;
-	beats_per_measure = 0;
+	metronomeWakeFd = wakeFd;
+
+	if (pthread_create(&metronomeThread, NULL, MetronomeThread, NULL) == 0)
+		metronomeThreadStarted = true;
+	else
+		printf("could not start the metronome thread\n");
 }
 
 void KillMetronome()
 {
 	if (metronome_enabled)
 		DisableMetronome();
-}
 
-void EnableMetronome()
-{
-	struct sigaction sa;
-
-	sa.sa_handler = MetronomeTimerProc;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
-	if (sigaction(SIGALRM, &sa, NULL) == -1)
+	if (metronomeThreadStarted)
 	{
-		perror("sigaction");
-		exit(1);
-	}
+		pthread_mutex_lock(&metronomeLock);
+		metronomeQuit = true;
+		pthread_cond_signal(&metronomeChanged);
+		pthread_mutex_unlock(&metronomeLock);
 
-	// Set up the initial timer interval
-	struct itimerval timer;
-	timer.it_interval.tv_sec = 60 / bpm;
-	timer.it_interval.tv_usec = (60 % bpm) * 1000000 / bpm;
-	timer.it_value = timer.it_interval;
-	setitimer(ITIMER_REAL, &timer, NULL);
+		// it might be asleep until the next bar, and there is no point waiting for that
+		pthread_cancel(metronomeThread);
+		pthread_join(metronomeThread, NULL);
+		metronomeThreadStarted = false;
+	}
+}
 
+void EnableMetronome()
+{
+	pthread_mutex_lock(&metronomeLock);
+	metronomeRestart = true;
+	atomic_fetch_add(&metronomeGeneration, 1);
 	metronome_enabled = true;
+	pthread_cond_signal(&metronomeChanged);
+	pthread_mutex_unlock(&metronomeLock);
 }
 
+// clicks already queued for the rest of the bar are thrown away by DoMetronome()
+// (and if the metronome is turned back on before it gets to them, they are stale by then)
 void DisableMetronome()
 {
-	// how to disable signal??
 	metronome_enabled = false;
 }
 
-// call this in a tight loop; it increases the beat count, and incremements the current measure, plus plays the .TIC sound
-void DoMetronome()
+// with no time signature, every beat is a bar of its own
+// (beats_per_measure is only read once, since another thread can change it at any time)
+int BeatsInBar()
 {
-	if (metronome_enabled && timer_flag)
+	int beats = beats_per_measure;
+	return beats ? beats : 1;
+}
+
+// works out where every click of one bar falls (in microseconds from the start of the bar), and how
+// loud it is; when we are sending MIDI clock, the pulses (and the start message, in front of the
+// first bar) are mixed in too; returns how many entries there are, sorted by time
+int BuildBar(double beatUs, int beats, bool first, double *offsets, int *levels)
+{
+	int subs = subdivisions;
+	double swingRatio = swing;
+	int count = 0;
+
+	if (clockMode == CLOCK_MASTER)
 	{
+		if (first)
+		{
+			offsets[count] = 0;
+			levels[count++] = CLOCK_START;
+		}
 
-		if (beat == 0 || beats_per_measure == 0)
-			DoTick(1);
-		else
-			DoTick(0);
+		for (int p = 0; p < beats * MIDI_CLOCK_PPQN; p++)
+		{
+			offsets[count] = p * beatUs / MIDI_CLOCK_PPQN;
+			levels[count++] = CLOCK_PULSE;
+		}
+	}
+
+	for (int b = 0; b < beats; b++)
+	{
+		for (int s = 0; s < subs; s++)
+		{
+			double position = s;
+
+			// swing pushes back the second click of each pair (only makes sense for even subdivisions)
+			if (subs % 2 == 0 && s % 2 == 1)
+				position = s - 1 + 2 * swingRatio;
+
+			offsets[count] = (b + position / subs) * beatUs;
+
+			if (s > 0)
+				levels[count] = CLICK_SUBDIVISION;
+			else if (b == 0)
+				levels[count] = CLICK_DOWNBEAT; // with no time signature, every beat is a downbeat
+			else
+				levels[count] = CLICK_BEAT;
+
+			count++;
+		}
+	}
+
+	// the clicks only need merging in with the clock pulses (a stable insertion sort keeps the
+	// start message in front of the first pulse, and each pulse in front of a click at the same time)
+	for (int i = 1; i < count; i++)
+	{
+		double offset = offsets[i];
+		int level = levels[i];
+		int j = i;
 
-		if (beats_per_measure == 0)
+		for (; j > 0 && offsets[j - 1] > offset; j--)
 		{
-			beat++;
+			offsets[j] = offsets[j - 1];
+			levels[j] = levels[j - 1];
 		}
-		else if (beat++ == (beats_per_measure - 1))
+		offsets[j] = offset;
+		levels[j] = level;
+	}
+
+	return count;
+}
+
+void *MetronomeThread(void *arg)
+{
+	double barStart = 0;	 // microseconds (on the same clock as MicroTime()) the next bar starts
+	int barsPlayed = 0;		 // since the metronome was last turned on; drives the tempo map
+	unsigned generation = 0; // metronomeGeneration as of the last restart
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (1)
+	{
+		double offsets[MAX_CLICKS_PER_BAR];
+		int levels[MAX_CLICKS_PER_BAR];
+		double beatUs;
+		int beats, count;
+		long long wake, now;
+		struct timespec ts;
+
+		// nothing to do until the metronome is turned on
+		pthread_mutex_lock(&metronomeLock);
+		while (!metronome_enabled && !metronomeQuit)
+			pthread_cond_wait(&metronomeChanged, &metronomeLock);
+		if (metronomeQuit)
 		{
-			beat = 0;
+			pthread_mutex_unlock(&metronomeLock);
+			break;
+		}
+		if (metronomeRestart)
+		{
+			// the first bar starts as soon as we can still get it out on time
+			barStart = MicroTime() + lookahead * 1000LL;
+			barsPlayed = 0;
+			generation = atomic_load(&metronomeGeneration);
+			metronomeRestart = false;
+		}
+		pthread_mutex_unlock(&metronomeLock);
+
+		// the whole bar is worked out up front, at the tempo it starts with
+		beatUs = 60000000.0 / atomic_load(&bpm);
+		beats = BeatsInBar();
+		count = BuildBar(beatUs, beats, barsPlayed == 0, offsets, levels);
+
+		wake = (long long)barStart - lookahead * 1000LL;
+		ts.tv_sec = wake / 1000000;
+		ts.tv_nsec = (wake % 1000000) * 1000;
+
+		// KillMetronome() may cancel us, but only while we are asleep here (never holding metronomeLock)
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		now = MicroTime();
+		LatencyRecord(&wakeLateness, (int)(now - wake));
+
+		// we might have been turned off (or restarted) while we were asleep
+		// (and when we are following someone else's clock, the MIDI thread plays the clicks instead)
+		if (metronome_enabled && !metronomeRestart && clockMode != CLOCK_SLAVE)
+		{
+			QueueBar(barStart, now, offsets, levels, count, generation);
 			measure++;
 		}
 
-		timer_flag = 0;
+		barStart += beats * beatUs;
+
+		barsPlayed++;
+		int stepBars = tempoStepBars;
+		if (stepBars > 0 && barsPlayed % stepBars == 0 && clockMode != CLOCK_SLAVE && !atomic_load(&tempoFollow))
+		{
+			double next = atomic_load(&bpm) + tempoStepBpm;
+			atomic_store(&bpm, next < MIN_BPM ? MIN_BPM : next > MAX_BPM ? MAX_BPM : next);
+		}
+	}
+
+	return NULL;
+}
+
+// hands a whole bar of clicks over to the MIDI thread at once
+void QueueBar(double barStart, long long now, const double *offsets, const int *levels, int count, unsigned generation)
+{
+	unsigned int head = atomic_load_explicit(&clickHead, memory_order_relaxed);
+	PmTimestamp ptNow = Pt_Time();
+
+	for (int i = 0; i < count; i++)
+	{
+		if (head - atomic_load_explicit(&clickTail, memory_order_acquire) == CLICK_QUEUE_SIZE)
+		{
+			droppedClicks += count - i;
+			break;
+		}
+
+		clickQueue[head % CLICK_QUEUE_SIZE].level = levels[i];
+		clickQueue[head % CLICK_QUEUE_SIZE].when = ptNow + (PmTimestamp)((barStart + offsets[i] - now + 500) / 1000);
+		clickQueue[head % CLICK_QUEUE_SIZE].generation = generation;
+		clickQueue[head % CLICK_QUEUE_SIZE].handOverUs = (long long)(barStart + offsets[i]) - lookahead * 1000LL;
+		head++;
+	}
+
+	atomic_store_explicit(&clickHead, head, memory_order_release);
+
+	if (metronomeWakeFd >= 0)
+	{
+		uint64_t one = 1;
+		write(metronomeWakeFd, &one, sizeof(one));
+	}
+}
+
+// call this in a tight loop (from the MIDI thread); it plays each queued click lookahead ms before
+// it is due, stamped with the time it is actually meant to sound
+// clicks left over from before the metronome was last (re)started are thrown away, not played
+// alongside the new ones
+void DoMetronome()
+{
+	unsigned int tail = atomic_load_explicit(&clickTail, memory_order_relaxed);
+	unsigned generation = atomic_load(&metronomeGeneration);
+
+	// whoever is following our clock needs to know we stopped
+	if (clockRunning && (!metronome_enabled || clockMode != CLOCK_MASTER))
+	{
+		DoTick(CLOCK_STOP, Pt_Time());
+		clockRunning = false;
+	}
+
+	while (tail != atomic_load_explicit(&clickHead, memory_order_acquire))
+	{
+		Click *click = &clickQueue[tail % CLICK_QUEUE_SIZE];
+
+		// once we have stopped sending clock, any pulses still queued are thrown away
+		bool stale = click->generation != generation || (click->level >= CLOCK_PULSE && clockMode != CLOCK_MASTER);
+
+		if (metronome_enabled && !stale)
+		{
+			if (Pt_Time() + lookahead < click->when)
+				break; // not time for this one yet (and the rest are later still)
+
+			if (Pt_Time() > click->when)
+				lateClicks++;
+			LatencyRecord(&clickLateness, (int)(MicroTime() - click->handOverUs));
+			if (click->level == CLOCK_START)
+				clockRunning = true;
+			DoTick(click->level, click->when);
+		}
+
+		atomic_store_explicit(&clickTail, ++tail, memory_order_release);
 	}
 }
 
-void setBeatsPerMinute(const int BPM)
+// tells the caller when DoMetronome() next has a click to hand over; returns false if none are queued
+bool NextMetronomeTime(PmTimestamp *when)
 {
-	DisableMetronome();
-	bpm = BPM;
-	EnableMetronome();
+	unsigned int tail = atomic_load_explicit(&clickTail, memory_order_relaxed);
+
+	if (tail == atomic_load_explicit(&clickHead, memory_order_acquire))
+		return false;
+
+	*when = clickQueue[tail % CLICK_QUEUE_SIZE].when - lookahead;
+	return true;
+}
+
+// prints the metronome's settings, and how accurately its thread has been waking up for each bar
+void ShowMetronomeStatistics()
+{
+	printf("metronome: %.2f bpm, %s\n", atomic_load(&bpm), metronome_enabled ? "enabled" : "disabled");
+	printf("%d clicks per beat, swing %.2f\n", (int)subdivisions, (double)swing);
+	if (tempoStepBars > 0)
+		printf("tempo map: %+.2f bpm every %d bars%s\n", (double)tempoStepBpm, (int)tempoStepBars,
+			   atomic_load(&tempoFollow) ? " (off while following the player)" : "");
+	if (atomic_load(&tempoFollow))
+		printf("following the player's tempo\n");
+	if (clockMode == CLOCK_MASTER)
+		printf("sending MIDI clock\n");
+	if (clockMode == CLOCK_SLAVE)
+	{
+		if (atomic_load(&slaveBpm) > 0)
+			printf("following MIDI clock at %.2f bpm (%s, re-locked %lu times)\n", atomic_load(&slaveBpm),
+				   slaveRunning ? "playing" : "stopped", slaveRelocks);
+		else
+			printf("waiting for MIDI clock\n");
+	}
+
+	if (wakeLateness.count == 0)
+	{
+		printf("no bars played yet\n");
+		return;
+	}
+
+	LatencyPrint("wake-up lateness", &wakeLateness, "us");
+	if (clickLateness.count)
+		LatencyPrint("click hand-over lateness", &clickLateness, "us");
+	printf("clicks sent after their time: %lu\n", lateClicks);
+	printf("clicks dropped:               %lu\n", droppedClicks);
+}
+
+// a new tempo takes effect from the next bar; turns the metronome on if it wasn't already
+void setBeatsPerMinute(const double BPM)
+{
+	atomic_store(&bpm, BPM < MIN_BPM ? MIN_BPM : BPM > MAX_BPM ? MAX_BPM : BPM);
+	if (!metronome_enabled)
+		EnableMetronome();
+}
+
+// like setBeatsPerMinute(), but never turns the metronome on (the MIDI thread uses this to make the
+// metronome follow the player, or incoming MIDI clock); takes effect from the next bar
+void followBeatsPerMinute(const double BPM)
+{
+	atomic_store(&bpm, BPM < MIN_BPM ? MIN_BPM : BPM > MAX_BPM ? MAX_BPM : BPM);
+}
+
+// when TRUE, the MIDI thread keeps the metronome at the player's tempo, and the tempo map is suspended
+void setTempoFollow(const bool follow)
+{
+	atomic_store(&tempoFollow, follow);
+}
+
+bool getTempoFollow()
+{
+	return atomic_load(&tempoFollow);
+}
+
+// how far ahead of each click to hand it over to DoTick(); this should match the output latency,
+// so that the click still goes out on time even if the MIDI thread only gets around to it a little late
+void setMetronomeLookahead(const int ms)
+{
+	lookahead = ms;
 }
 
 void setBeatsPerMeasure(const int BeatsPerMeasure)
 {
-	beat = 0;
 	measure = 0;
-	beats_per_measure = BeatsPerMeasure;
+	beats_per_measure = BeatsPerMeasure < 0 ? 0 : BeatsPerMeasure > MAX_BEATS_PER_MEASURE ? MAX_BEATS_PER_MEASURE : BeatsPerMeasure;
+}
+
+// takes effect from the next bar
+void setSubdivisions(const int ClicksPerBeat, const double Swing)
+{
+	subdivisions = ClicksPerBeat < 1 ? 1 : ClicksPerBeat > MAX_SUBDIVISIONS ? MAX_SUBDIVISIONS : ClicksPerBeat;
+	swing = Swing < 0.5 ? 0.5 : Swing > 0.9 ? 0.9 : Swing;
+}
+
+// every Bars bars, change the tempo by BPM (which can be negative); 0 bars turns the tempo map off
+void setTempoMap(const double BPM, const int Bars)
+{
+	tempoStepBpm = BPM;
+	tempoStepBars = Bars;
+}
+
+// CLOCK_OFF, CLOCK_MASTER or CLOCK_SLAVE; call this from the MIDI thread (or before it starts),
+// since it resets the state ClockInput() uses; if the metronome is running, restart it afterwards with
+// EnableMetronome() (so that a start message goes out in front of the next bar)
+void setClockMode(const int Mode)
+{
+	clockMode = Mode;
+	slaveTickMs = 0;
+	slaveHaveTick = false;
+	slaveRunning = false;
+	atomic_store(&slaveBpm, 0);
 }
 
-// this function is called by timeSetEvent()
-// it just sets the timer_flag, which DoMetronome() looks at
-void MetronomeTimerProc()
+int getClockMode()
 {
-	timer_flag = 1;
+	return clockMode;
+}
+
+int getSubdivisions()
+{
+	return subdivisions;
+}
+
+double getSwing()
+{
+	return swing;
+}
+
+// plays the click (if any) that falls between the pulse we are expecting next and the one after it
+// (one pulse ahead is plenty of time to stamp it with exactly when the loop expects it)
+// swung clicks land between pulses, so they are stamped part of the way to the following pulse
+void SlaveClickForNextPulse()
+{
+	int subs = subdivisions;
+	double swingRatio = swing;
+	int pulsesPerClick = MIDI_CLOCK_PPQN / subs;
+	int beats = BeatsInBar();
+	int pulse = slavePulse % MIDI_CLOCK_PPQN; // within the beat
+
+	if (!slaveRunning || slaveTickMs == 0 || !metronome_enabled)
+		return;
+
+	for (int s = 0; s < subs; s++)
+	{
+		double position = s; // in clicks from the start of the beat, just like BuildBar()
+		int level;
+
+		if (subs % 2 == 0 && s % 2 == 1)
+			position = s - 1 + 2 * swingRatio;
+		position *= pulsesPerClick;
+
+		if (position < pulse || position >= pulse + 1)
+			continue;
+
+		if (s > 0)
+			level = CLICK_SUBDIVISION;
+		else if ((slavePulse / MIDI_CLOCK_PPQN) % beats == 0)
+			level = CLICK_DOWNBEAT;
+		else
+			level = CLICK_BEAT;
+
+		DoTick(level, (PmTimestamp)(slaveNextTick + (position - pulse) * slaveTickMs + 0.5));
+	}
+}
+
+// call this from the MIDI thread with every clock, start, continue and stop message that comes in
+// (only when following MIDI clock); it does a fixed small amount of work per message
+void ClockInput(const int status, const PmTimestamp when)
+{
+	double error;
+
+	switch (status)
+	{
+	case 0xFA: // start
+		slavePulse = 0;
+		slaveRunning = true;
+		measure = 0;
+		SlaveClickForNextPulse();
+		return;
+	case 0xFB: // continue
+		slaveRunning = true;
+		return;
+	case 0xFC: // stop
+		slaveRunning = false;
+		return;
+	case 0xF8: // clock
+		break;
+	default:
+		return;
+	}
+
+	if (slaveTickMs == 0)
+	{
+		// we need two pulses to get going
+		if (slaveHaveTick && when > slaveLastTick)
+		{
+			slaveTickMs = when - slaveLastTick;
+			slaveNextTick = when + slaveTickMs;
+		}
+		slaveLastTick = when;
+		slaveHaveTick = true;
+	}
+	else
+	{
+		error = when - slaveNextTick;
+		if (error > slaveTickMs * PLL_MAX_ERROR_PULSES || error < -slaveTickMs * PLL_MAX_ERROR_PULSES)
+		{
+			// the clock stopped for a while, or jumped; lock on again from here
+			slaveTickMs = 0;
+			slaveLastTick = when;
+			slaveRelocks++;
+		}
+		else
+		{
+			slaveTickMs += PLL_FREQUENCY_GAIN * error;
+			if (slaveTickMs < 60000.0 / (MAX_BPM * MIDI_CLOCK_PPQN))
+				slaveTickMs = 60000.0 / (MAX_BPM * MIDI_CLOCK_PPQN);
+			if (slaveTickMs > 60000.0 / (MIN_BPM * MIDI_CLOCK_PPQN))
+				slaveTickMs = 60000.0 / (MIN_BPM * MIDI_CLOCK_PPQN);
+			slaveNextTick += slaveTickMs + PLL_PHASE_GAIN * error;
+		}
+	}
+
+	if (slaveRunning)
+	{
+		slavePulse++;
+		if (slavePulse % (MIDI_CLOCK_PPQN * BeatsInBar()) == 0)
+			measure++;
+	}
+
+	if (slaveTickMs > 0)
+	{
+		atomic_store(&slaveBpm, 60000.0 / (slaveTickMs * MIDI_CLOCK_PPQN));
+
+		// once a beat, bring the metronome's own tempo into line, so it's right if we stop following
+		if (slavePulse % MIDI_CLOCK_PPQN == 0)
+			followBeatsPerMinute(atomic_load(&slaveBpm));
+	}
+
+	SlaveClickForNextPulse();
 }
@@ -1,10 +1,47 @@
 #pragma once
 
+#include <stdbool.h>
 
-void InitMetronome();
+#include "portmidi/portmidi.h"
+
+// what DoTick() is asked to play: a click (and how loud it is), or a MIDI clock message
+#define CLICK_SUBDIVISION 0
+#define CLICK_BEAT 1
+#define CLICK_DOWNBEAT 2
+#define CLOCK_PULSE 3
+#define CLOCK_START 4
+#define CLOCK_STOP 5
+
+// MIDI clock modes
+#define CLOCK_OFF 0
+#define CLOCK_MASTER 1 // send MIDI clock along with the clicks
+#define CLOCK_SLAVE 2  // follow incoming MIDI clock
+#define MIDI_CLOCK_PPQN 24
+
+// limits for the settings below
+#define MAX_BEATS_PER_MEASURE 6
+#define MAX_SUBDIVISIONS 4
+#define MAX_CLICKS_PER_BAR (MAX_BEATS_PER_MEASURE * (MAX_SUBDIVISIONS + MIDI_CLOCK_PPQN) + 1)
+#define MIN_BPM 20
+#define MAX_BPM 400
+
+void InitMetronome(int wakeFd);
 void KillMetronome();
 void EnableMetronome();
 void DisableMetronome();
 void DoMetronome();
-void setBeatsPerMinute(const int BPM);
+bool NextMetronomeTime(PmTimestamp *when);
+void setBeatsPerMinute(const double BPM);
+void followBeatsPerMinute(const double BPM);
+void setTempoFollow(const bool follow);
+bool getTempoFollow();
 void setBeatsPerMeasure(const int BeatsPerMeasure);
+void setSubdivisions(const int ClicksPerBeat, const double Swing);
+void setTempoMap(const double BPM, const int Bars);
+void setMetronomeLookahead(const int ms);
+void ShowMetronomeStatistics();
+void setClockMode(const int Mode);
+int getClockMode();
+int getSubdivisions();
+double getSwing();
+void ClockInput(const int status, const PmTimestamp when);
@@ -0,0 +1,224 @@
+//
+// Observer.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Observer scripts: lua scripts that only watch what is being played (to analyse it, log it, etc.)
+// and never change the output. Unlike the main script they don't run on the MIDI thread at all;
+// the callback copies each incoming event into a lock-free ring, and an ordinary priority worker
+// thread hands them to the script's observe_midi(status, data1, data2, timestamp) function.
+//
+// If the script can't keep up and the ring fills, events are dropped (and counted); the MIDI
+// thread never waits for the observer. Each call to observe_midi gets OBSERVER_BUDGET_US before it
+// is aborted, so a script stuck in a loop can't keep the worker (and anyone unloading it) waiting.
+//
+// Usage:
+//	InitObserver();
+//	LoadObserverScript("scripts/watch.lua");	// from the main thread
+//	ObserveEvents(events, count);				// from the callback
+//	KillObserver();
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lua/include/lualib.h"
+#include "lua/include/lauxlib.h"
+
+#include "observer.h"
+#include "bytecache.h"
+#include "latency.h"
+
+#define OBSERVER_RING_SIZE 4096 // must be a power of 2
+
+PmEvent observerRing[OBSERVER_RING_SIZE];
+atomic_uint observerHead; // next slot the callback writes to
+atomic_uint observerTail; // next slot the worker reads from
+atomic_ulong observerDropped;
+atomic_bool observerLoaded; // the callback doesn't bother queuing anything unless this is set
+
+// the observer's lua state belongs to the worker thread; the lock just keeps the main thread from
+// swapping it out while the worker is in the middle of using it
+lua_State *observerState;
+int observeMidiRef = LUA_NOREF;
+pthread_mutex_t observerLock = PTHREAD_MUTEX_INITIALIZER;
+
+volatile bool observer_running;
+pthread_t observer_thread;
+
+// every call into the observer script gets this long; unloading it cuts a call short right away
+#define OBSERVER_BUDGET_US 100000
+#define OBSERVER_CHECK_INSTRUCTIONS 1000
+long long observerDeadline; // these two are only used by the worker thread
+bool observerInCall;
+atomic_bool observerAbort;
+
+// private routines
+void *ObserverThreadProc(void *arg);
+void ObserverBudgetHook(lua_State *L, lua_Debug *ar);
+
+// aborts the call in progress (with a lua error) if it has run out of time, or someone wants the script gone
+// does nothing outside our own lua_pcall(), where raising an error would panic
+void ObserverBudgetHook(lua_State *L, lua_Debug *ar)
+{
+	if (observerInCall && (atomic_load(&observerAbort) || MicroTime() > observerDeadline))
+		luaL_error(L, "observer script took too long");
+}
+
+void InitObserver()
+{
+	atomic_store(&observerHead, 0);
+	atomic_store(&observerTail, 0);
+	atomic_store(&observerDropped, 0);
+
+	observer_running = true;
+	pthread_create(&observer_thread, NULL, ObserverThreadProc, NULL);
+}
+
+void KillObserver()
+{
+	if (observer_running)
+	{
+		observer_running = false;
+		pthread_join(observer_thread, NULL);
+	}
+
+	UnloadObserverScript();
+}
+
+// loads the script into a new lua state, and swaps it in for the worker
+// returns false (after printing why) if the script couldn't be loaded; any previous observer keeps running
+bool LoadObserverScript(const char *filename)
+{
+	lua_State *L = luaL_newstate();
+	int ref;
+
+	luaL_openlibs(L);
+
+	if (LoadCachedLuaFile(L, filename) != LUA_OK || lua_pcall(L, 0, LUA_MULTRET, 0) != LUA_OK)
+	{
+		printf("error in observer script: %s\n", lua_tostring(L, -1));
+		lua_close(L);
+		return false;
+	}
+
+	lua_getglobal(L, "observe_midi");
+	if (!lua_isfunction(L, -1))
+	{
+		printf("no observe_midi function defined in observer script\n");
+		lua_close(L);
+		return false;
+	}
+	ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_sethook(L, ObserverBudgetHook, LUA_MASKCOUNT, OBSERVER_CHECK_INSTRUCTIONS);
+
+	atomic_store(&observerAbort, true);
+	pthread_mutex_lock(&observerLock);
+	atomic_store(&observerAbort, false);
+	if (observerState)
+		lua_close(observerState);
+	observerState = L;
+	observeMidiRef = ref;
+	pthread_mutex_unlock(&observerLock);
+
+	atomic_store(&observerLoaded, true);
+	return true;
+}
+
+void UnloadObserverScript()
+{
+	atomic_store(&observerLoaded, false);
+
+	// don't wait for the worker to finish whatever it's doing in the old script
+	atomic_store(&observerAbort, true);
+	pthread_mutex_lock(&observerLock);
+	atomic_store(&observerAbort, false);
+	if (observerState)
+		lua_close(observerState);
+	observerState = NULL;
+	observeMidiRef = LUA_NOREF;
+	pthread_mutex_unlock(&observerLock);
+}
+
+// called from the callback; copies the events into the ring if there is room, otherwise drops them
+void ObserveEvents(const PmEvent *events, int count)
+{
+	unsigned int head, tail;
+
+	if (!atomic_load_explicit(&observerLoaded, memory_order_relaxed))
+		return;
+
+	head = atomic_load_explicit(&observerHead, memory_order_relaxed);
+	tail = atomic_load_explicit(&observerTail, memory_order_acquire);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (head - tail >= OBSERVER_RING_SIZE)
+		{
+			atomic_fetch_add_explicit(&observerDropped, count - i, memory_order_relaxed);
+			break;
+		}
+
+		observerRing[head & (OBSERVER_RING_SIZE - 1)] = events[i];
+		head++;
+	}
+
+	atomic_store_explicit(&observerHead, head, memory_order_release);
+}
+
+unsigned long ObserverDroppedCount()
+{
+	return atomic_load(&observerDropped);
+}
+
+// hands everything in the ring to the observer script every few milliseconds
+void *ObserverThreadProc(void *arg)
+{
+	while (observer_running)
+	{
+		unsigned int tail = atomic_load_explicit(&observerTail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&observerHead, memory_order_acquire);
+
+		if (tail != head)
+		{
+			pthread_mutex_lock(&observerLock);
+
+			while (tail != head)
+			{
+				PmEvent *event = &observerRing[tail & (OBSERVER_RING_SIZE - 1)];
+
+				if (observerState)
+				{
+					lua_rawgeti(observerState, LUA_REGISTRYINDEX, observeMidiRef);
+					lua_pushinteger(observerState, Pm_MessageStatus(event->message));
+					lua_pushinteger(observerState, Pm_MessageData1(event->message));
+					lua_pushinteger(observerState, Pm_MessageData2(event->message));
+					lua_pushinteger(observerState, event->timestamp);
+
+					observerDeadline = MicroTime() + OBSERVER_BUDGET_US;
+					observerInCall = true;
+					if (lua_pcall(observerState, 4, 0, 0) != 0)
+						printf("error running function `observe_midi': %s\n", lua_tostring(observerState, -1));
+					observerInCall = false;
+
+					lua_settop(observerState, 0);
+				}
+
+				tail++;
+				atomic_store_explicit(&observerTail, tail, memory_order_release);
+
+				// someone is waiting to swap the script out; let them have the lock
+				if (atomic_load(&observerAbort))
+					break;
+			}
+
+			pthread_mutex_unlock(&observerLock);
+		}
+
+		usleep(5000);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "portmidi/portmidi.h"
+
+void InitObserver();
+void KillObserver();
+bool LoadObserverScript(const char *filename);
+void UnloadObserverScript();
+void ObserveEvents(const PmEvent *events, int count);
+unsigned long ObserverDroppedCount();
@@ -15,6 +15,8 @@
 
 const char *VersionString = "2.0";
 
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -26,11 +28,26 @@ const char *VersionString = "2.0";
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "portmidi/portmidi.h"
 #include "portmidi/pmutil.h"
 #include "portmidi/porttime.h"
 #include "metronome.h"
+#include "logring.h"
+#include "latency.h"
+#include "rawmidi.h"
+#include "scheduler.h"
+#include "tempotrack.h"
+#include "luascript.h"
+#include "bytecache.h"
+#include "observer.h"
 #include "logo.h"
 
 #include "lua/include/lua.h"
@@ -54,6 +71,18 @@ PmStream *midi_out; // (transposed) outgoing midi
 #define IN_QUEUE_SIZE 1024
 #define OUT_QUEUE_SIZE 1024
 
+// midi_out is opened with this much latency (in ms), so that events stamped with a time in the
+// future (metronome clicks, scheduled events) are sent out by the driver exactly on time
+// portmidi delivers every event at its timestamp plus the latency (and a timestamp of 0 means "now",
+// so that would be outputLatency late too); anything we want to go out right away is stamped
+// outputLatency in the past instead (see NowForOutput())
+#define DEFAULT_OUTPUT_LATENCY_MS 10
+int outputLatency = DEFAULT_OUTPUT_LATENCY_MS;
+
+// portmidi wants the timestamps written to a stream to never go backwards; this is the last one the
+// MIDI thread wrote (see WriteMidiOut())
+PmTimestamp lastOutTimestamp;
+
 int MIDIchannel = 0;
 int MIDIInputDevice = -1;  // -1 means to use the default; this can be overridden on the commmand line
 int MIDIOutputDevice = -1; // -1 means to use the default; this can be overridden on the commmand line
@@ -61,14 +90,21 @@ int MIDIOutputDevice = -1; // -1 means to use the default; this can be overridde
 bool ShowMIDIData;
 int NoteOffset = 0;
 
-extern int bpm;
-extern bool metronome_enabled;
+extern _Atomic double bpm;
+extern atomic_bool metronome_enabled;
 
 char SCRIPT_LOCATION[] = "scripts/";
 
-lua_State *Lua_State;
-bool script_is_loaded = FALSE;
-char script_file[255];
+// the scripts making up the lua pipeline, in the order they run; each one's output feeds the next
+// the main thread and the file watcher both use these, so hold scriptFilesLock while touching them
+#define MAX_LUA_STAGES 8
+char script_files[MAX_LUA_STAGES][255];
+int scriptStageCount = 0;
+pthread_mutex_t scriptFilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// how long things have to be quiet after a script is written before we reload it
+#define RELOAD_DEBOUNCE_MS 100
 
 // NOTE: it is possible to compile this code without using the NATS library at all
 // additionally, if we ARE compiling with NATS, then
@@ -84,7 +120,7 @@ typedef struct
 {
 
 	int cmdCode;
-	int Param1;
+	int Param1; // sequence id, filled in by SendCallbackCommand() and echoed back in the ACK
 	int Param2;
 
 } CommandMessage;
@@ -93,10 +129,23 @@ typedef struct
 #define CMD_QUIT_MSG 1
 #define CMD_SET_SPLIT_POINT 2
 #define CMD_SET_MODE 3
+#define CMD_RESET_LATENCY 4
+#define CMD_SET_NOTE_MAPS 5
+#define CMD_SET_CLOCK_MODE 6
 
-// ackknowledgement of received message
+// ackknowledgement of received message (Param1 is the id of the command, Param2 its cmdCode)
 #define CMD_MSG_ACK 1000
 
+// how long the main thread waits for the callback to acknowledge a command
+#define ACK_TIMEOUT_MS 1000
+
+// eventfd counters, so neither side has to spin waiting for the other:
+// ackEventFd is signalled by the callback whenever it queues a response for the main thread,
+// wakeEventFd is signalled by the main thread whenever it queues a command, and by the metronome thread whenever
+// it queues a bar of clicks (only the event driven input thread sleeps on it)
+int ackEventFd = -1;
+int wakeEventFd = -1;
+
 // flag indicating
 int callback_exit_flag;
 
@@ -108,10 +157,21 @@ enum transpositionModes
 	RIGHT_DESCENDING,
 	MIRROR_IMAGE
 };
+#define NUM_TRANSPOSITION_MODES 4
 
-enum transpositionModes transpositionMode = NO_TRANSPOSITION;
+// only the callback changes this (the main thread asks it to with CMD_SET_MODE)
+_Atomic enum transpositionModes transpositionMode = NO_TRANSPOSITION;
 int splitPoint = 62; // default to middle d
 
+// the transposition (plus NoteOffset) is done with a 128 entry lookup table for each mode
+// there are two sets of tables, so the main thread can rebuild one set while the callback is still
+// using the other; then it asks the callback to switch sets (CMD_SET_NOTE_MAPS)
+// only the callback ever changes noteMapSet or currentNoteMap
+unsigned char noteMaps[2][NUM_TRANSPOSITION_MODES][128];
+atomic_int noteMapSet;
+_Atomic(const unsigned char *) currentNoteMap;
+int noteMapsPending = -1; // (main thread) a set we asked the callback to switch to, that it never acknowledged
+
 // 0 means no threshold; just let through all notes...
 // otherwise, this number represents the highest velocity number that we will let through
 int velocityThreshhold = 0;
@@ -119,6 +179,56 @@ int midiEchoDisabled = 0;
 
 int callback_active = FALSE;
 
+// process_midi_2() drains up to eventsPerTick events from the input each time it is called,
+// and writes all of the resulting output with a single Pm_Write()
+#define MAX_EVENTS_PER_TICK 256
+int eventsPerTick = 64; // can be overridden on the command line
+
+// counters describing how much MIDI data we handle per callback tick
+unsigned long statTicks;	 // number of ticks where we read at least one event
+unsigned long statEventsIn;	 // total events read
+unsigned long statEventsOut; // total events written
+unsigned long statFullTicks; // ticks where the batch was full (so more data was probably waiting)
+int statMaxEventsPerTick;
+
+// input to output latency, measured from the timestamp portmidi gives the incoming event to the
+// time portmidi will actually deliver it (its output timestamp plus outputLatency); kept separately
+// for each transposition mode, and with/without lua
+LatencyHistogram latencyHistograms[NUM_TRANSPOSITION_MODES][2];
+
+// when reading from a raw MIDI device (-r on the command line), a dedicated thread blocks on the device
+// instead of using the 1ms portmidi callback; wakeEventFd is how the main thread pokes it
+char *rawMidiDevice = NULL;
+int rawMidiFd = -1;
+pthread_t midi_input_thread;
+
+// real-time options for whichever thread ends up doing our MIDI processing (all off by default)
+// the MIDI thread applies these to itself the first time it runs, and records how that went
+int rtPriority = 0;	 // SCHED_FIFO priority, or 0 to leave the scheduler alone
+int cpuCore = -1;	 // core to pin the MIDI thread to, or -1 to let it float
+bool lockMemory = FALSE; // mlockall() everything, so we never take a page fault while playing
+
+int rtPriorityResult;	 // 0 on success, otherwise an errno value
+int cpuCoreResult;		 // 0 on success, otherwise an errno value
+int lockMemoryResult;	 // 0 on success, otherwise an errno value
+atomic_int midiThreadConfigured;
+
+// scheduled lua garbage collection (-G on the command line); 0 means let lua collect whenever it likes
+// the time budget is one 1ms tick, and we only collect if at least GC_MIN_SPARE_US of it is left
+#define TICK_BUDGET_US 1000
+#define GC_MIN_SPARE_US 500
+// if the player never leaves us a quiet tick, we collect anyway after this many busy ticks in a row,
+// or as soon as any stage's heap grows past GC_FORCE_HEAP_KB, rather than letting the heap grow forever
+#define GC_FORCE_AFTER_TICKS 100
+#define GC_FORCE_HEAP_KB 512
+int luaGCStepKB = 0;
+bool luaGCPending = FALSE; // TRUE until the collector finishes a cycle after we last ran lua code
+int luaGCSkippedTicks;	   // busy ticks in a row where we put off collecting
+
+void ProcessEvents(PmEvent *events, int count);
+void FlushScheduledEvents();
+int MidiThreadPollTimeout();
+
 #if defined(USE_NATS)
 char *nats_url = DEFAULT_NATS_URL;
 natsConnection *conn = NULL;
@@ -161,46 +271,79 @@ bool isFirstTime = TRUE;
 
 bool ShouldReloadFile(char *filename);
 
-void DoTick(int accent)
+// the timestamp that makes portmidi deliver an event right away (with no outputLatency on top)
+PmTimestamp NowForOutput()
 {
+	return Pt_Time() - outputLatency;
+}
 
-	PmEvent buffer;
+// writes events (in time order) to midi_out from the MIDI thread
+// clicks are stamped up to outputLatency ahead of events we echo right away, so an echo that follows a
+// click can't be stamped earlier than it; it goes out together with the click instead
+void WriteMidiOut(PmEvent *events, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (events[i].timestamp < lastOutTimestamp)
+			events[i].timestamp = lastOutTimestamp;
+		lastOutTimestamp = events[i].timestamp;
+	}
+
+	Pm_Write(midi_out, events, count);
+}
+
+// plays one metronome click (or MIDI clock message), so that it sounds at the given time
+// (portmidi adds outputLatency to every timestamp, so we take it back off here)
+void DoTick(int level, PmTimestamp when)
+{
+
+	PmEvent buffer[2];
 	int i;
-	PmError err;
 
 	static int count = 0;
 
-	if (accent)
+	buffer[0].timestamp = buffer[1].timestamp = when - outputLatency;
+
+	if (level == CLOCK_PULSE || level == CLOCK_START || level == CLOCK_STOP)
 	{
-		buffer.message = Pm_Message(144, 107, 60);
-		err = Pm_Write(midi_out, &buffer, 1);
+		buffer[0].message = Pm_Message(level == CLOCK_PULSE ? 0xF8 : level == CLOCK_START ? 0xFA : 0xFC, 0, 0);
+		WriteMidiOut(buffer, 1);
+		return;
+	}
 
-		buffer.message = Pm_Message(128, 107, 0);
-		err = Pm_Write(midi_out, &buffer, 1);
+	if (level == CLICK_DOWNBEAT)
+	{
+		buffer[0].message = Pm_Message(144, 107, 60);
+		buffer[1].message = Pm_Message(128, 107, 0);
+	}
+	else if (level == CLICK_BEAT)
+	{
+		buffer[0].message = Pm_Message(144, 50, 60);
+		buffer[1].message = Pm_Message(128, 50, 0);
 	}
 	else
 	{
-		buffer.message = Pm_Message(144, 50, 60);
-		err = Pm_Write(midi_out, &buffer, 1);
-
-		buffer.message = Pm_Message(128, 50, 0);
-		err = Pm_Write(midi_out, &buffer, 1);
+		buffer[0].message = Pm_Message(144, 50, 30);
+		buffer[1].message = Pm_Message(128, 50, 0);
 	}
 
+	WriteMidiOut(buffer, 2);
+
 	if (count < 12)
 		count++;
 	else
 		count = 0;
 }
 
-// takes an input node, and maps it according to current transposition mode
-PmMessage TransformNote(PmMessage Note)
+// takes an input node, and maps it according to the given transposition mode
+// (this is only used to fill in the lookup tables below; the callback never calls it directly)
+int MapNote(enum transpositionModes mode, int Note)
 {
 
-	PmMessage retval = Note;
+	int retval = Note;
 	int offset;
 
-	switch (transpositionMode)
+	switch (mode)
 	{
 
 	case NO_TRANSPOSITION:
@@ -210,37 +353,37 @@ PmMessage TransformNote(PmMessage Note)
 
 	// make left hand ascend
 	case LEFT_ASCENDING:
-		if (Note < 62)
+		if (Note < splitPoint)
 		{
-			offset = (62 - Note);
-			retval = 62 + offset;
+			offset = (splitPoint - Note);
+			retval = splitPoint + offset;
 		} // else do nothing;
 		break;
 
 	// make right hand descend
 	case RIGHT_DESCENDING:
-		if (Note > 62)
+		if (Note > splitPoint)
 		{
-			offset = (Note - 62);
-			retval = 62 - offset;
+			offset = (Note - splitPoint);
+			retval = splitPoint - offset;
 		} // else do nothing;
 		break;
 
 	// completely reverse the keyboard
 	case MIRROR_IMAGE:
-		if (Note == 62)
+		if (Note == splitPoint)
 		{
 			// do nothing
 		}
-		else if (Note < 62)
+		else if (Note < splitPoint)
 		{
-			offset = (62 - Note);
-			retval = 62 + offset;
+			offset = (splitPoint - Note);
+			retval = splitPoint + offset;
 		}
-		else if (Note > 62)
+		else if (Note > splitPoint)
 		{
-			offset = (Note - 62);
-			retval = 62 - offset;
+			offset = (Note - splitPoint);
+			retval = splitPoint - offset;
 		}
 		break;
 	}
@@ -248,34 +391,63 @@ PmMessage TransformNote(PmMessage Note)
 	return retval;
 }
 
-// cycles through the transposition modes in turn
-// this routine is called when we detect a LOW A on the piano [which isn't used much, so we can just use it for input like this]
-void DoNextTranspositionMode()
+// fills in one lookup table for the given mode, with NoteOffset folded in
+// anything that would land outside of the MIDI note range is clamped to 0..127
+void BuildNoteMap(unsigned char *map, enum transpositionModes mode, int offset)
 {
-
-	switch (transpositionMode)
+	for (int note = 0; note < 128; note++)
 	{
+		int n = MapNote(mode, note) + offset;
 
-	case NO_TRANSPOSITION:
-		transpositionMode = LEFT_ASCENDING;
-		printf("Left hand ascending mode active\n");
-		break;
+		if (n < 0)
+			n = 0;
+		else if (n > 127)
+			n = 127;
 
-	case LEFT_ASCENDING:
-		transpositionMode = RIGHT_DESCENDING;
-		printf("Right Hand Descending mode active\n");
-		break;
+		map[note] = n;
+	}
+}
 
-	case RIGHT_DESCENDING:
-		transpositionMode = MIRROR_IMAGE;
-		printf("Keyboard mirring mode active\n");
-		break;
+// switches over to the lookup table for the given mode in the given set
+// only the callback calls this (apart from initialize(), before the callback is running)
+void SelectNoteMap(int set, enum transpositionModes mode)
+{
+	atomic_store(&noteMapSet, set);
+	transpositionMode = mode;
+	atomic_store_explicit(&currentNoteMap, noteMaps[set][mode], memory_order_release);
+}
 
-	case MIRROR_IMAGE:
-		transpositionMode = NO_TRANSPOSITION;
-		printf("no tranposition active\n");
-		break;
-	}
+// fills in the lookup tables for all modes in the given set, for the current NoteOffset
+void BuildNoteMaps(int set)
+{
+	for (int mode = NO_TRANSPOSITION; mode < NUM_TRANSPOSITION_MODES; mode++)
+		BuildNoteMap(noteMaps[set][mode], mode, NoteOffset);
+}
+
+// takes an input node, and maps it according to current transposition mode
+PmMessage TransformNote(PmMessage Note)
+{
+	return atomic_load_explicit(&currentNoteMap, memory_order_acquire)[Note & 0x7F];
+}
+
+const char *transpositionModeNames[NUM_TRANSPOSITION_MODES] = {
+	"no tranposition active\n",
+	"Left hand ascending mode active\n",
+	"Right Hand Descending mode active\n",
+	"Keyboard mirring mode active\n"};
+
+// returns the mode after the given one, wrapping around at the end
+enum transpositionModes NextTranspositionMode(enum transpositionModes mode)
+{
+	return (mode + 1) % NUM_TRANSPOSITION_MODES;
+}
+
+// cycles through the transposition modes in turn
+// this routine is called from the callback when we detect a LOW A on the piano [which isn't used much, so we can just use it for input like this]
+void DoNextTranspositionMode()
+{
+	SelectNoteMap(noteMapSet, NextTranspositionMode(transpositionMode));
+	LogText("%s", transpositionModeNames[transpositionMode]);
 }
 
 void exit_with_message(char *msg)
@@ -286,14 +458,81 @@ void exit_with_message(char *msg)
 	exit(1);
 }
 
+// queue a command for the callback (or the input thread), and make sure it notices
+// returns the sequence id to pass to WaitForAck()
+int SendCallbackCommand(CommandMessage *msg)
+{
+	static int commandSeq = 0;
+	uint64_t one = 1;
+
+	msg->Param1 = ++commandSeq;
+	Pm_Enqueue(main_to_callback, msg);
+	write(wakeEventFd, &one, sizeof(one));
+
+	return msg->Param1;
+}
+
+// acknowledge a command from the main thread, and wake it up if it is waiting in WaitForAck()
+void SendAck(CommandMessage *cmd)
+{
+	CommandMessage response;
+	uint64_t one = 1;
+
+	response.cmdCode = CMD_MSG_ACK;
+	response.Param1 = cmd->Param1;
+	response.Param2 = cmd->cmdCode;
+	Pm_Enqueue(callback_to_main, &response);
+	write(ackEventFd, &one, sizeof(one));
+}
+
+// sleeps until the callback acknowledges command seq, or timeoutMs goes by
+// a late ACK for an earlier command that we already gave up on is thrown away
+// returns TRUE if we got the acknowledgement
+bool WaitForAck(int seq, int timeoutMs)
+{
+	CommandMessage response;
+	struct pollfd fd;
+	PtTimestamp deadline = Pt_Time() + timeoutMs;
+
+	fd.fd = ackEventFd;
+	fd.events = POLLIN;
+
+	while (1)
+	{
+		while (Pm_Dequeue(callback_to_main, &response) == 1)
+		{
+			if (response.cmdCode == CMD_MSG_ACK && response.Param1 == seq)
+				return TRUE;
+		}
+
+		int remaining = deadline - Pt_Time();
+		if (remaining <= 0)
+			return FALSE;
+
+		if (poll(&fd, 1, remaining) > 0)
+		{
+			uint64_t dummy;
+			read(ackEventFd, &dummy, sizeof(dummy));
+		}
+	}
+}
+
+// switches MIDI clock modes; this has to happen on the MIDI thread, since it resets the state the
+// MIDI thread uses to follow incoming clock, and changes the filter on the stream it is reading
+void SwitchClockMode(int mode)
+{
+	setClockMode(mode);
+	if (midi_in)
+		Pm_SetFilter(midi_in, mode == CLOCK_SLAVE ? PM_FILT_ACTIVE : PM_FILT_ACTIVE | PM_FILT_CLOCK);
+}
+
 // setup to work with digital_piano_1
 void process_midi_1(PtTimestamp timestamp, void *userData)
 {
 	PmError result;
 	PmEvent buffer;
 
-	CommandMessage cmd;		 // incoming message from main()
-	CommandMessage response; // our responses back to main()
+	CommandMessage cmd; // incoming message from main()
 
 	// if we're not intialized, do nothing
 	if (!callback_active)
@@ -312,17 +551,23 @@ void process_midi_1(PtTimestamp timestamp, void *userData)
 			switch (cmd.cmdCode)
 			{
 			case CMD_QUIT_MSG:
-				response.cmdCode = CMD_MSG_ACK;
-				Pm_Enqueue(callback_to_main, &response);
+				SendAck(&cmd);
 				callback_active = FALSE;
 				return;
 				// no break needed; above statement just exits function
 			case CMD_SET_SPLIT_POINT:
 				break;
 			case CMD_SET_MODE:
-				transpositionMode = (cmd.Param1);
-				response.cmdCode = CMD_MSG_ACK;
-				Pm_Enqueue(callback_to_main, &response);
+				SelectNoteMap(noteMapSet, cmd.Param2);
+				SendAck(&cmd);
+				break;
+			case CMD_SET_NOTE_MAPS:
+				SelectNoteMap(cmd.Param2, transpositionMode);
+				SendAck(&cmd);
+				break;
+			case CMD_SET_CLOCK_MODE:
+				SwitchClockMode(cmd.Param2);
+				SendAck(&cmd);
 				break;
 			}
 		}
@@ -345,7 +590,7 @@ void process_midi_1(PtTimestamp timestamp, void *userData)
 			data2 = Pm_MessageData2(buffer.message);
 
 			if (ShowMIDIData)
-				printf("input:  %d, %d, %d\n", Pm_MessageStatus(buffer.message), Pm_MessageData1(buffer.message), Pm_MessageData2(buffer.message));
+				LogInts("input:  %d, %d, %d\n", status, data1, data2);
 
 			// do transposition logic
 			PmMessage NewNote = TransformNote(data1);
@@ -365,9 +610,10 @@ void process_midi_1(PtTimestamp timestamp, void *userData)
 
 				buffer.message =
 					Pm_Message(status, NewNote, Pm_MessageData2(buffer.message));
+				buffer.timestamp = NowForOutput(); // send it right away
 
 				if (shouldEcho)
-					Pm_Write(midi_out, &buffer, 1);
+					WriteMidiOut(&buffer, 1);
 			}
 
 #if defined(USE_NATS)
@@ -394,24 +640,148 @@ void process_midi_1(PtTimestamp timestamp, void *userData)
 	} while (result);
 }
 
-// setup to work with digital_piano_2
-void process_midi_2(PtTimestamp timestamp, void *userData)
+// when scheduled garbage collection is turned on, lua's own collector is stopped, and instead we
+// do one bounded step of collection at the end of any tick that finished with time to spare
+// (or at the end of a busy one, if we've been putting it off for too long)
+void RunScheduledLuaGC(long long tickStart)
 {
-	PmError result;
-	PmEvent buffer;
+	LuaScript *script;
+	bool force = FALSE;
 
-	CommandMessage cmd;		 // incoming message from main()
-	CommandMessage response; // our responses back to main()
+	if (!luaGCStepKB || !luaGCPending)
+		return;
 
-	// if we're not intialized, do nothing
-	if (!callback_active)
+	if (MicroTime() - tickStart > TICK_BUDGET_US - GC_MIN_SPARE_US)
+	{
+		if (++luaGCSkippedTicks >= GC_FORCE_AFTER_TICKS)
+			force = TRUE;
+		for (script = AcquireLuaScript(); script && !force; script = script->next)
+			if (LuaHeapKB(script) > GC_FORCE_HEAP_KB)
+				force = TRUE;
+		ReleaseLuaScript();
+
+		if (!force)
+			return; // this tick was busy enough already; try again next time
+	}
+	luaGCSkippedTicks = 0;
+
+	// every stage has its own lua state, and so its own garbage to collect
+	luaGCPending = FALSE;
+	for (script = AcquireLuaScript(); script; script = script->next)
+		if (!StepLuaGC(script, luaGCStepKB))
+			luaGCPending = TRUE;
+	ReleaseLuaScript();
+}
+
+// sends everything scripts have scheduled (with emit_at) whose time has come, in one Pm_Write()
+// like metronome clicks, events are handed over outputLatency ms early, and portmidi sends them on time
+void FlushScheduledEvents()
+{
+	PmEvent events[MAX_EVENTS_PER_TICK];
+	int count = TakeDueEvents(Pt_Time() + outputLatency, events, MAX_EVENTS_PER_TICK);
+
+	for (int i = 0; i < count; i++)
+		events[i].timestamp -= outputLatency;
+
+	if (count > 0 && !midiEchoDisabled)
+	{
+		WriteMidiOut(events, count);
+		statEventsOut += count;
+	}
+}
+
+// how long (in ms) MidiInputThread() can sleep in poll() before it has something to do
+// that the piano won't wake it up for; -1 means forever
+int MidiThreadPollTimeout()
+{
+	PmTimestamp when, next;
+	bool waiting = FALSE;
+
+	// the garbage collector still relies on being checked every millisecond while it has work
+	// left over from the last batch of events
+	if (luaGCPending)
+		return 1;
+
+	if (NextScheduledTime(&when))
+	{
+		next = when - outputLatency;
+		waiting = TRUE;
+	}
+
+	// the metronome thread wakes us up when it queues a bar, but we have to hand each click over ourselves
+	if (NextMetronomeTime(&when) && (!waiting || when < next))
+	{
+		next = when;
+		waiting = TRUE;
+	}
+
+	if (waiting)
+	{
+		PmTimestamp wait = next - Pt_Time();
+		return wait > 0 ? wait : 0;
+	}
+
+	return -1;
+}
+
+// applies the real-time options from the command line to the calling thread
+// this has to run ON the MIDI thread, since the portmidi timer thread isn't ours to get a handle to
+void ConfigureMidiThread()
+{
+	if (rtPriority > 0)
+	{
+		struct sched_param param;
+		param.sched_priority = rtPriority;
+		rtPriorityResult = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	}
+
+	if (cpuCore >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpuCore, &cpus);
+		cpuCoreResult = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	atomic_store(&midiThreadConfigured, TRUE);
+}
+
+// prints which of the real-time options actually took effect
+// (waits a little while for the MIDI thread to get around to applying them)
+void ShowRealTimeReport()
+{
+	if (rtPriority == 0 && cpuCore < 0 && !lockMemory)
+		return;
+
+	for (int i = 0; i < 100 && !atomic_load(&midiThreadConfigured); i++)
+		usleep(10000);
+
+	printf("real-time setup:\n");
+
+	if (lockMemory)
+		printf("  lock memory:               %s\n", lockMemoryResult ? strerror(lockMemoryResult) : "ok");
+
+	if (!atomic_load(&midiThreadConfigured))
 	{
+		printf("  MIDI thread never started; priority and affinity not applied\n");
 		return;
 	}
 
-	DoMetronome();
+	if (rtPriority > 0)
+		printf("  SCHED_FIFO priority %-3d    %s\n", rtPriority, rtPriorityResult ? strerror(rtPriorityResult) : "ok");
+
+	if (cpuCore >= 0)
+		printf("  pin MIDI thread to core %-2d %s\n", cpuCore, cpuCoreResult ? strerror(cpuCoreResult) : "ok");
+}
+
+// process messages from the main thread
+// returns FALSE if we were told to quit
+bool HandleCallbackCommands()
+{
+	PmError result;
+
+	CommandMessage cmd; // incoming message from main()
 
-	// process messages from the main thread
 	do
 	{
 		result = Pm_Dequeue(main_to_callback, &cmd);
@@ -420,133 +790,369 @@ void process_midi_2(PtTimestamp timestamp, void *userData)
 			switch (cmd.cmdCode)
 			{
 			case CMD_QUIT_MSG:
-				response.cmdCode = CMD_MSG_ACK;
-				Pm_Enqueue(callback_to_main, &response);
+				SendAck(&cmd);
 				callback_active = FALSE;
-				return;
+				return FALSE;
 				// no break needed; above statement just exits function
 			case CMD_SET_SPLIT_POINT:
 				break;
 			case CMD_SET_MODE:
-				transpositionMode = (cmd.Param1);
-				response.cmdCode = CMD_MSG_ACK;
-				Pm_Enqueue(callback_to_main, &response);
+				SelectNoteMap(noteMapSet, cmd.Param2);
+				SendAck(&cmd);
+				break;
+			case CMD_SET_NOTE_MAPS:
+				SelectNoteMap(cmd.Param2, transpositionMode);
+				SendAck(&cmd);
+				break;
+			case CMD_SET_CLOCK_MODE:
+				SwitchClockMode(cmd.Param2);
+				SendAck(&cmd);
+				break;
+			case CMD_RESET_LATENCY:
+				memset(latencyHistograms, 0, sizeof(latencyHistograms));
 				break;
 			}
 		}
 	} while (result);
 
-	// process incoming midi data, performing transposion as necessary
-	do
+	return TRUE;
+}
+
+// setup to work with digital_piano_2
+void process_midi_2(PtTimestamp timestamp, void *userData)
+{
+	int count;
+	long long tickStart;
+	PmEvent events[MAX_EVENTS_PER_TICK]; // everything we read from the piano this tick
+
+	// if we're not intialized, do nothing
+	if (!callback_active)
 	{
-		result = Pm_Poll(midi_in);
-		if (result)
-		{
-			int status, data1, data2;
-			if (Pm_Read(midi_in, &buffer, 1) == pmBufferOverflow)
-				continue;
+		return;
+	}
 
-			// we have some MIDI data to look at
+	if (!atomic_load_explicit(&midiThreadConfigured, memory_order_relaxed))
+		ConfigureMidiThread();
 
-			status = Pm_MessageStatus(buffer.message);
-			data1 = Pm_MessageData1(buffer.message);
-			data2 = Pm_MessageData2(buffer.message);
+	DoMetronome();
 
-			if (ShowMIDIData)
-				printf("input:  %d, %d, %d\n", Pm_MessageStatus(buffer.message), Pm_MessageData1(buffer.message), Pm_MessageData2(buffer.message));
+	if (!HandleCallbackCommands())
+		return;
 
-			// do transposition logic
-			data1 = TransformNote(data1);
+	tickStart = MicroTime();
 
-			// if (status != 128)
-			//{
-			status = status + NoteOffset;
-			//}
+	// drain up to eventsPerTick events in one go, instead of polling and reading them one at a time
+	// (on overflow portmidi flushes its buffer and we just pick up again on the next tick)
+	count = Pm_Read(midi_in, events, eventsPerTick);
+	if (count > 0)
+		ProcessEvents(events, count);
 
-			// if (ShowMIDIData)
-			// printf("output:  %d, %d, %d\n", status, data1, data2);
+	FlushScheduledEvents();
+	RunScheduledLuaGC(tickStart);
+}
 
-			// do logic associated with quite mode
-			int shouldEcho = (data2 < velocityThreshhold) || (velocityThreshhold == 0);
+// event driven alternative to process_midi_2(), used when reading from a raw MIDI device
+// instead of sitting in a 1ms polling loop, this thread sleeps in poll() until the piano
+// sends us something, or the main thread pokes us because it queued up a command
+void *MidiInputThread(void *arg)
+{
+	struct pollfd fds[2];
+	unsigned char bytes[MAX_EVENTS_PER_TICK];
+	PmEvent events[MAX_EVENTS_PER_TICK];
+	RawMidiParser parser;
 
-			///////////////////////////////////////////////
-			// this code needs debugged!!
-			///////////////////////////////////////////////
+	RawMidiReset(&parser);
+	ConfigureMidiThread();
 
-			if (Lua_State && script_is_loaded)
-			{
+	fds[0].fd = rawMidiFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = wakeEventFd;
+	fds[1].events = POLLIN;
 
-				// Push the fib function on the top of the lua stack
-				lua_getglobal(Lua_State, "process_midi");
+	while (callback_active)
+	{
+		if (poll(fds, 2, MidiThreadPollTimeout()) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			break;
+		}
 
-				// make sure the .Lua function process_midi is defined
-				if (lua_isfunction(Lua_State, -1))
-				{
+		long long tickStart = MicroTime();
 
-					lua_pushnumber(Lua_State, status);
-					lua_pushnumber(Lua_State, data1);
-					lua_pushnumber(Lua_State, data2);
+		DoMetronome();
 
-					if (lua_pcall(Lua_State, 3, 3, 0) == 0)
-					{
+		if (fds[1].revents & POLLIN)
+		{
+			uint64_t dummy;
+			read(wakeEventFd, &dummy, sizeof(dummy));
+		}
 
-						// Get the result from the lua stack
-						if ((lua_gettop(Lua_State) == 3 && lua_isnumber(Lua_State, -3) && lua_isnumber(Lua_State, -2) && lua_isnumber(Lua_State, -1)))
-						{
-							status = (int)lua_tointeger(Lua_State, -3);
-							data1 = (int)lua_tointeger(Lua_State, -2);
-							data2 = (int)lua_tointeger(Lua_State, -1);
-						}
-						else
-							printf("function 'process_midi' must return 3 numbers\n");
-
-						// Clean up.  If we don't do this last step, we'll leak stack memory.
-						lua_settop(Lua_State, 0); // discard anything returned, since we don't really know how many items were returned for sure
-												  // lua_pop(Lua_State, 3);
-					}
-					else
-					{
-						printf("error running function `process_midi': %s\n", lua_tostring(Lua_State, -1));
-					}
-				}
-				else
-					printf("no process_midi function defined in loaded .Lua script\n");
-			}
+		if (!HandleCallbackCommands())
+			break;
 
-			// actually write the midi message [after all our processing] unless
-			// local MIDI echo is disabled
-			if (!midiEchoDisabled)
+		if (fds[0].revents & POLLIN)
+		{
+			// each event needs at least one byte, so reading at most eventsPerTick bytes
+			// means we can never produce more events than we have room for
+			int n = read(rawMidiFd, bytes, eventsPerTick);
+			if (n > 0)
 			{
+				parser.keepClock = (getClockMode() == CLOCK_SLAVE);
+				int count = RawMidiParse(&parser, bytes, n, events, Pt_Time());
+				if (count > 0)
+					ProcessEvents(events, count);
+			}
+		}
+		else if (fds[0].revents & (POLLERR | POLLHUP))
+		{
+			LogText("%s", "raw MIDI device went away\n");
+			break;
+		}
 
-				buffer.message =
-					Pm_Message(status, data1, data2);
+		FlushScheduledEvents();
+		RunScheduledLuaGC(tickStart);
+	}
 
-				if (shouldEcho)
-					Pm_Write(midi_out, &buffer, 1);
-			}
+	return NULL;
+}
+
+// runs one batch of incoming events through the transposition (and lua), and writes the results
+// events must have room for MAX_EVENTS_PER_TICK entries, since a batch script may add events
+void ProcessEvents(PmEvent *events, int count)
+{
+	int outCount;
+	int usedLua;
+	LuaScript *script, *stage;
+	long long stageStart;
+	bool tempoChanged = FALSE;
+
+	PmEvent outEvents[MAX_EVENTS_PER_TICK]; // everything we are going to echo back this tick
+	bool shouldEcho[MAX_EVENTS_PER_TICK];
+
+	// when we are following MIDI clock, clock messages are for the metronome, and go no further
+	if (getClockMode() == CLOCK_SLAVE)
+	{
+		int kept = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			int status = Pm_MessageStatus(events[i].message);
+
+			if (status == 0xF8 || (status >= 0xFA && status <= 0xFC))
+				ClockInput(status, events[i].timestamp);
+			else
+				events[kept++] = events[i];
+		}
+
+		count = kept;
+		if (count == 0)
+			return;
+	}
+
+	statTicks++;
+	statEventsIn += count;
+	if (count > statMaxEventsPerTick)
+		statMaxEventsPerTick = count;
+	if (count == eventsPerTick)
+		statFullTicks++;
+
+	// observer scripts get to see exactly what was played
+	ObserveEvents(events, count);
+
+	// process incoming midi data, performing transposion as necessary
+	for (int i = 0; i < count; i++)
+	{
+		int status, data1, data2;
+
+		// we have some MIDI data to look at
+
+		status = Pm_MessageStatus(events[i].message);
+		data1 = Pm_MessageData1(events[i].message);
+		data2 = Pm_MessageData2(events[i].message);
+
+		if (ShowMIDIData)
+			LogInts("input:  %d, %d, %d\n", status, data1, data2);
+
+		// keep track of the player's tempo (a note-on with velocity 0 is really a note-off)
+		if ((status & 0xF0) == 0x90 && data2 > 0)
+			tempoChanged |= TrackOnset(events[i].timestamp);
+
+		// do transposition logic (NoteOffset is already folded into the lookup table)
+		// only note on/off and polyphonic aftertouch carry a note number
+		if (status < 0xB0)
+			data1 = TransformNote(data1);
+
+		events[i].message = Pm_Message(status, data1, data2);
+
+		// do logic associated with quite mode
+		shouldEcho[i] = (data2 < velocityThreshhold) || (velocityThreshhold == 0);
+	}
+
+	if (tempoChanged)
+	{
+		// in follow mode, the metronome picks up the player's tempo from its next bar
+		// (after a long pause the tracker starts over, and we just keep the last tempo until it locks on again)
+		if (getTempoFollow() && TrackedTempo() > 0)
+			followBeatsPerMinute(TrackedTempo());
 
 #if defined(USE_NATS)
-			// if we are using NATs, and we are configured to echo MIDI over nats,
-			// then publish the midi event as a NATs message
-			if (natsbroadcast)
-			{
-				const int[2] * payload;
-				payload[0] = status;
-				payload[1] = data1;
-				payload[2] = data2;
+		// let anyone listening on NATs know the tempo the player is at (0 when we have lost track of it)
+		if (natsbroadcast)
+		{
+			char tempo[16];
+			snprintf(tempo, sizeof(tempo), "%.1f", TrackedTempo());
+			natsConnection_PublishString(conn, "tempo", tempo);
+		}
+#endif
+	}
 
-				const char *subj = "midiOUT";
+	// let each stage of the lua pipeline have a go, in order; a pure script's answers were all worked
+	// out when it was loaded, a script that defines process_midi_buffer (or process_midi_batch) gets
+	// the whole tick at once, otherwise we call process_midi for each event
+	script = AcquireLuaScript();
+	usedLua = FALSE;
+	for (stage = script; stage && count > 0; stage = stage->next)
+	{
+		if (!LuaScriptHasHandler(stage))
+			continue;
 
-				return natsConnection_Publish(nc, subj, (const void *)payload, 3);
+		usedLua = TRUE;
+		stageStart = MicroTime();
+
+		if (stage->pureMap)
+		{
+			ApplyPureMap(stage, events, count);
+		}
+		else if (stage->processMidiBufferRef != LUA_NOREF || stage->processMidiBatchRef != LUA_NOREF)
+		{
+			luaGCPending = TRUE;
+			if (stage->processMidiBufferRef != LUA_NOREF)
+				count = CallLuaProcessMidiBuffer(stage, events, count, MAX_EVENTS_PER_TICK);
+			else
+				count = CallLuaProcessMidiBatch(stage, events, count, MAX_EVENTS_PER_TICK);
+
+			// the output doesn't line up with the input any more, so quiet mode looks at what the script returned
+			for (int i = 0; i < count; i++)
+			{
+				int data2 = Pm_MessageData2(events[i].message);
+				shouldEcho[i] = (data2 < velocityThreshhold) || (velocityThreshhold == 0);
 			}
+		}
+		else
+		{
+			luaGCPending = TRUE;
+			for (int i = 0; i < count; i++)
+				CallLuaProcessMidi(stage, &events[i]);
+		}
+
+		RecordLuaStageTime(stage, (long)(MicroTime() - stageStart));
+	}
+	ReleaseLuaScript();
+
+	outCount = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int data1 = Pm_MessageData1(events[i].message);
+		int data2 = Pm_MessageData2(events[i].message);
+
+		// a script can leave empty slots behind (buf:setcount() fills new ones with zeros); those aren't
+		// MIDI messages at all, so they go nowhere
+		if (Pm_MessageStatus(events[i].message) < 0x80)
+			continue;
+
+		// queue up the midi message [after all our processing] unless
+		// local MIDI echo is disabled
+		if (!midiEchoDisabled && shouldEcho[i])
+			outEvents[outCount++] = events[i];
+
+#if defined(USE_NATS)
+		// if we are using NATs, and we are configured to echo MIDI over nats,
+		// then publish the midi event as a NATs message
+		if (natsbroadcast)
+		{
+			int status = Pm_MessageStatus(events[i].message);
+			const int[2] * payload;
+			payload[0] = status;
+			payload[1] = data1;
+			payload[2] = data2;
+
+			const char *subj = "midiOUT";
+
+			natsConnection_Publish(nc, subj, (const void *)payload, 3);
+		}
 #endif
 
-			if (data1 == 21 && data2 == 0)
+		if (data1 == 21 && data2 == 0)
+		{
+			DoNextTranspositionMode();
+		}
+	}
+
+	// actually write everything out in a single call
+	if (outCount > 0)
+	{
+		LatencyHistogram *h = &latencyHistograms[transpositionMode][usedLua];
+		PtTimestamp now = Pt_Time();
+		PmTimestamp inTimestamps[MAX_EVENTS_PER_TICK];
+
+		// we're done with the input timestamps; restamp everything so it goes out right away
+		for (int i = 0; i < outCount; i++)
+		{
+			inTimestamps[i] = outEvents[i].timestamp;
+			outEvents[i].timestamp = now - outputLatency;
+		}
+
+		WriteMidiOut(outEvents, outCount);
+
+		// (WriteMidiOut() may have held some of them back a little, behind a metronome click)
+		for (int i = 0; i < outCount; i++)
+			LatencyRecord(h, outEvents[i].timestamp + outputLatency - inTimestamps[i]);
+		statEventsOut += outCount;
+	}
+}
+
+// prints the counters kept by process_midi_2()
+void ShowEventStatistics()
+{
+	printf("callback ticks with input:  %lu\n", statTicks);
+	printf("events read:                %lu\n", statEventsIn);
+	printf("events written:             %lu\n", statEventsOut);
+	printf("max events in one tick:     %d (batch size %d)\n", statMaxEventsPerTick, eventsPerTick);
+	printf("ticks with a full batch:    %lu\n", statFullTicks);
+	printf("dropped log messages:       %lu\n", LogDroppedCount());
+	printf("events dropped by observer: %lu\n", ObserverDroppedCount());
+	printf("scheduled events waiting:   %d\n", ScheduledEventCount());
+	printf("scheduler overflows:        %lu\n", SchedulerOverflowCount());
+	if (statTicks)
+		printf("average events per tick:    %.2f\n", (double)statEventsIn / statTicks);
+}
+
+// prints the input to output latency for each mode, then starts collecting again from scratch
+void ShowLatency()
+{
+	CommandMessage msg;
+	char name[STRING_MAX];
+	bool any = FALSE;
+
+	printf("input to output latency (until portmidi delivers each event):\n");
+	for (int mode = 0; mode < NUM_TRANSPOSITION_MODES; mode++)
+	{
+		for (int lua = 0; lua < 2; lua++)
+		{
+			if (latencyHistograms[mode][lua].count)
 			{
-				DoNextTranspositionMode();
+				snprintf(name, STRING_MAX, "mode %d%s", mode, lua ? " + lua" : "");
+				LatencyPrint(name, &latencyHistograms[mode][lua], "ms");
+				any = TRUE;
 			}
 		}
-	} while (result);
+	}
+	if (!any)
+		printf("no events recorded yet\n");
+
+	// the callback owns the histograms, so ask it to clear them
+	msg.cmdCode = CMD_RESET_LATENCY;
+	SendCallbackCommand(&msg);
 }
 
 void initialize()
@@ -554,13 +1160,35 @@ void initialize()
 	const PmDeviceInfo *info;
 	int id;
 
+	// build our note lookup tables before the callback can run
+	BuildNoteMaps(0);
+	SelectNoteMap(0, NO_TRANSPOSITION);
+
+	// lock everything we have now and will ever allocate into memory
+	if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		lockMemoryResult = errno;
+
+	// the callback logs through this, rather than calling printf() itself
+	InitLog();
+	InitObserver();
+
 	/* make the message queues */
 	main_to_callback = Pm_QueueCreate(IN_QUEUE_SIZE, sizeof(CommandMessage));
 	assert(main_to_callback != NULL);
 	callback_to_main = Pm_QueueCreate(OUT_QUEUE_SIZE, sizeof(CommandMessage));
 	assert(callback_to_main != NULL);
 
-	if (false)
+	ackEventFd = eventfd(0, EFD_NONBLOCK);
+	wakeEventFd = eventfd(0, EFD_NONBLOCK);
+	if (ackEventFd < 0 || wakeEventFd < 0)
+	{
+		perror("eventfd");
+		exit(1);
+	}
+
+	if (rawMidiDevice)
+		Pt_Start(1, NULL, 0); // we still need portmidi's clock, but our own thread does the work
+	else if (false)
 		Pt_Start(1, &process_midi_1, 0);
 	else
 		Pt_Start(1, &process_midi_2, 0);
@@ -587,34 +1215,51 @@ void initialize()
 				  OUT_QUEUE_SIZE,
 				  NULL,
 				  NULL,
-				  0);
-
-	// open default midi input device, if nothing was specified on the command line
-	if (MIDIInputDevice == -1)
-		id = Pm_GetDefaultInputDeviceID();
-	else
-		id = MIDIInputDevice;
+				  outputLatency);
+	setMetronomeLookahead(outputLatency);
+	InitMetronome(wakeEventFd);
 
-	info = Pm_GetDeviceInfo(id);
-	if (info == NULL)
+	if (rawMidiDevice)
 	{
-		printf("Could not open default input device (%d).", id);
-		exit_with_message("");
+		printf("Opening raw MIDI input device %s\n", rawMidiDevice);
+		rawMidiFd = RawMidiOpen(rawMidiDevice);
+		if (rawMidiFd < 0)
+			exit_with_message("Could not open raw MIDI input device.");
+
 	}
-	printf("Opening input device %d %s %s\n", id, info->interf, info->name);
-	Pm_OpenInput(&midi_in,
-				 id,
-				 NULL,
-				 0,
-				 NULL,
-				 NULL);
+	else
+	{
+		// open default midi input device, if nothing was specified on the command line
+		if (MIDIInputDevice == -1)
+			id = Pm_GetDefaultInputDeviceID();
+		else
+			id = MIDIInputDevice;
 
-	Pm_SetFilter(midi_in, PM_FILT_ACTIVE | PM_FILT_CLOCK);
+		info = Pm_GetDeviceInfo(id);
+		if (info == NULL)
+		{
+			printf("Could not open default input device (%d).", id);
+			exit_with_message("");
+		}
+		printf("Opening input device %d %s %s\n", id, info->interf, info->name);
+		Pm_OpenInput(&midi_in,
+					 id,
+					 NULL,
+					 0,
+					 NULL,
+					 NULL);
+
+		// incoming clock is thrown away, unless the metronome is following it
+		Pm_SetFilter(midi_in, getClockMode() == CLOCK_SLAVE ? PM_FILT_ACTIVE : PM_FILT_ACTIVE | PM_FILT_CLOCK);
+	}
 
 	printf("Using MIDI echo back channel %d\n", MIDIchannel);
 
 	callback_active = TRUE;
 
+	if (rawMidiDevice)
+		pthread_create(&midi_input_thread, NULL, MidiInputThread, NULL);
+
 #if defined(USE_NATS)
 
 	if (natsbroadcast || natsreceive)
@@ -663,16 +1308,24 @@ void shutdown()
 	KillMetronome();
 
 	// close down our lua interpreter
-	if (Lua_State)
+	PublishLuaScript(NULL);
+
+	if (rawMidiDevice)
 	{
-		lua_close(Lua_State);
+		pthread_join(midi_input_thread, NULL);
+		RawMidiClose(rawMidiFd);
 	}
 
 	Pt_Stop();
+	KillObserver();
+	KillLog();
 	Pm_QueueDestroy(callback_to_main);
 	Pm_QueueDestroy(main_to_callback);
+	close(ackEventFd);
+	close(wakeEventFd);
 
-	Pm_Close(midi_in);
+	if (midi_in)
+		Pm_Close(midi_in);
 	Pm_Close(midi_out);
 
 	Pm_Terminate();
@@ -692,55 +1345,63 @@ void shutdown()
 void signalExitToCallBack()
 {
 
-	int gotFinalAck;
-
 	CommandMessage msg;
-	CommandMessage response;
+	int seq;
 
 	// send a quit message to the callback
 	msg.cmdCode = CMD_QUIT_MSG;
-	Pm_Enqueue(main_to_callback, &msg);
+	seq = SendCallbackCommand(&msg);
 
 	// wait for the callback to send back acknowledgement
-	gotFinalAck = FALSE;
-	do
-	{
-		if (Pm_Dequeue(callback_to_main, &response) == 1)
-		{
-			if (response.cmdCode == CMD_MSG_ACK)
-			{
-				int i = 1;
-				gotFinalAck = TRUE;
-			}
-		}
-	} while (!gotFinalAck);
+	// (if it never does, it isn't running anyway, so we can still go ahead and shut down)
+	if (!WaitForAck(seq, ACK_TIMEOUT_MS))
+		printf("MIDI callback did not acknowledge quit message\n");
 }
 
-// send a quit message to the callback function
+// tell the callback to switch transposition modes,
 // then wait around until it sends us an ACK back
 void set_transposition_mode(enum transpositionModes newmode)
 {
-	int receivedAck;
-
 	CommandMessage msg;
-	CommandMessage response;
+	int seq;
 
 	msg.cmdCode = CMD_SET_MODE;
-	msg.Param1 = newmode;
-	Pm_Enqueue(main_to_callback, &msg);
+	msg.Param2 = newmode;
+	seq = SendCallbackCommand(&msg);
 
 	// wait for the callback to send back acknowledgement
-	receivedAck = FALSE;
-	do
+	if (!WaitForAck(seq, ACK_TIMEOUT_MS))
+		printf("MIDI callback did not acknowledge mode change\n");
+}
+
+// rebuilds the lookup tables for all modes (call this whenever NoteOffset changes)
+// the new tables are built in the set that the callback isn't using, and then it is asked to switch to them
+void UpdateNoteMaps()
+{
+	int set, seq;
+	CommandMessage msg;
+
+	// if the callback never acknowledged our last switch, that command may still be waiting in the queue,
+	// and we mustn't rebuild the set it is about to switch to (unless it already has)
+	if (noteMapsPending >= 0 && atomic_load(&noteMapSet) != noteMapsPending)
 	{
-		if (Pm_Dequeue(callback_to_main, &response) == 1)
-		{
-			if (response.cmdCode == CMD_MSG_ACK)
-			{
-				receivedAck = TRUE;
-			}
-		}
-	} while (!receivedAck);
+		printf("MIDI callback hasn't switched to the last note tables yet; try again\n");
+		return;
+	}
+	noteMapsPending = -1;
+
+	set = !atomic_load(&noteMapSet);
+	BuildNoteMaps(set);
+
+	msg.cmdCode = CMD_SET_NOTE_MAPS;
+	msg.Param2 = set;
+	seq = SendCallbackCommand(&msg);
+
+	if (!WaitForAck(seq, ACK_TIMEOUT_MS))
+	{
+		printf("MIDI callback did not acknowledge note table change\n");
+		noteMapsPending = set;
+	}
 }
 
 void list_midi_devices()
@@ -799,7 +1460,21 @@ void parseCmdLine(int argc, char **argv)
 					"   -i,  --input <0-9>          Specify MIDI input device number\n"
 					"   -o,  --output <0-9>         Specify MIDI output device number\n"
 					"   -c,  --channel <0-9>        Specify MIDI (echo back) channel number\n"
-					"   -e,  --noecho               disable local midi echo"
+					"   -e,  --noecho               disable local midi echo\n"
+					"   -r,  --rawmidi <device>     Read input from a raw MIDI device (e.g. /dev/snd/midiC1D0) on its own\n"
+					"                               event driven thread, instead of polling portmidi every 1ms\n"
+					"   -p,  --priority <1-99>      Run the MIDI thread with SCHED_FIFO real-time priority\n"
+					"   -a,  --affinity <core>      Pin the MIDI thread to the given CPU core\n"
+					"   -m,  --mlock                Lock all memory, to avoid page faults while playing\n"
+					"   -L,  --luapool <KB>         Memory pool for lua scripts in KB (default 1024, 0 = use malloc)\n"
+					"   -G,  --luagc <KB>           Stop lua's automatic garbage collector, and instead collect in steps\n"
+					"                               of <KB> at the end of MIDI ticks that have time to spare\n"
+					"   -B,  --luabudget <us>       Time a lua script gets per event before it is aborted (default 2000, 0 = no limit)\n"
+					"   -C,  --cache                Also keep compiled lua bytecode on disk (scripts/<name>.lua.cache)\n"
+					"   -O,  --outlatency <ms>      Output latency; clicks and scheduled events are sent this far ahead,\n"
+					"                               so they go out exactly on time (default 10, 0 = no timestamps)\n"
+					"   -k,  --clock <send|follow>  Send MIDI clock with the metronome, or make the metronome follow incoming clock\n"
+					"   -b,  --batch <1-256>        Maximum MIDI events processed per callback tick (default 64)\n"
 					"   -v,  --version              Displays version information\n"
 					"   -l,  --list                 List available MIDI devices\n"
 #ifdef USE_NATS
@@ -848,6 +1523,160 @@ void parseCmdLine(int argc, char **argv)
 					exit(1);
 				}
 			}
+			else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--rawmidi") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					rawMidiDevice = strdup(argv[i + 1]);
+				}
+				else
+				{
+					fprintf(stderr, "Error: -r needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--priority") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					rtPriority = atoi(argv[i + 1]);
+					if (rtPriority < 1 || rtPriority > 99)
+					{
+						fprintf(stderr, "Error: value must be between 1 and 99.\n");
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stderr, "Error: -p needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--affinity") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					cpuCore = atoi(argv[i + 1]);
+					if (cpuCore < 0 || cpuCore >= CPU_SETSIZE)
+					{
+						fprintf(stderr, "Error: invalid core number.\n");
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stderr, "Error: -a needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mlock") == 0)
+			{
+				lockMemory = TRUE;
+			}
+			else if (strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--luapool") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					int kb = atoi(argv[i + 1]);
+					if (kb < 0)
+					{
+						fprintf(stderr, "Error: value must be 0 or more.\n");
+						exit(1);
+					}
+					SetLuaPoolSize((size_t)kb * 1024);
+				}
+				else
+				{
+					fprintf(stderr, "Error: -L needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-G") == 0 || strcmp(argv[i], "--luagc") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					luaGCStepKB = atoi(argv[i + 1]);
+					if (luaGCStepKB < 1)
+					{
+						fprintf(stderr, "Error: value must be 1 or more.\n");
+						exit(1);
+					}
+					SetLuaScheduledGC(TRUE);
+				}
+				else
+				{
+					fprintf(stderr, "Error: -G needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--luabudget") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					int us = atoi(argv[i + 1]);
+					if (us < 0)
+					{
+						fprintf(stderr, "Error: value must be 0 or more.\n");
+						exit(1);
+					}
+					SetLuaBudget(us);
+				}
+				else
+				{
+					fprintf(stderr, "Error: -B needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--cache") == 0)
+			{
+				SetBytecodeDiskCache(TRUE);
+			}
+			else if (strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "--outlatency") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					outputLatency = atoi(argv[i + 1]);
+					if (outputLatency < 0)
+					{
+						fprintf(stderr, "Error: value must be 0 or more.\n");
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stderr, "Error: -O needs a value\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--clock") == 0)
+			{
+				if (i + 1 < argc && strcmp(argv[i + 1], "send") == 0)
+					setClockMode(CLOCK_MASTER);
+				else if (i + 1 < argc && strcmp(argv[i + 1], "follow") == 0)
+					setClockMode(CLOCK_SLAVE);
+				else
+				{
+					fprintf(stderr, "Error: -k needs to be either send or follow\n");
+					exit(1);
+				}
+			}
+			else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0)
+			{
+				if (i + 1 < argc)
+				{
+					eventsPerTick = atoi(argv[i + 1]);
+					if (eventsPerTick < 1 || eventsPerTick > MAX_EVENTS_PER_TICK)
+					{
+						fprintf(stderr, "Error: value must be between 1 and %d.\n", MAX_EVENTS_PER_TICK);
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stderr, "Error: -b needs a value\n");
+					exit(1);
+				}
+			}
 			else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0)
 			{
 				list_midi_devices();
@@ -937,6 +1766,19 @@ void ShowCommands()
 	printf("11 [enter] to load lua script\n");
 	printf("12 [enter] clear lua state\n");
 	printf("13 [enter] reload last script\n");
+	printf("14 [enter] show event statistics\n");
+	printf("15 [enter] show (and reset) latency histogram\n");
+	printf("16 [enter] show lua memory and garbage collection statistics\n");
+	printf("17 [enter] load observer script\n");
+	printf("18 [enter] unload observer script\n");
+	printf("19 [enter] add lua script to the end of the pipeline\n");
+	printf("20 [enter] show lua pipeline stage timing\n");
+	printf("21 [enter] show metronome timing\n");
+	printf("22 [enter] set metronome subdivisions and swing\n");
+	printf("23 [enter] set metronome tempo map\n");
+	printf("24 [enter] show the tempo you are playing at\n");
+	printf("25 [enter] make the metronome follow your tempo (on\\off)\n");
+	printf("26 [enter] set MIDI clock mode\n");
 	printf(" q [enter] to quit\n");
 }
 
@@ -956,88 +1798,204 @@ int fileexists(const char *filename)
 	return 0;
 }
 
-void LoadLuaScript()
+// loads every script in the pipeline into new lua environments (on this thread, not the MIDI thread),
+// then swaps them all in at once
+// each time we call this function, we create new environments
+// this is so that we can have a script loaded... then change it, and reload our changes
+// if any of the scripts don't load, whatever was running before keeps running (and we return FALSE)
+// call with scriptFilesLock held, so a reload can't publish a pipeline built from a stale list
+bool SwapInLuaPipeline()
 {
+	LuaScript *script;
 
-	char tmp[255];
-	char ext[] = ".lua";
+	for (int i = 0; i < scriptStageCount; i++)
+	{
+		if (!fileexists(script_files[i]))
+		{
+			printf("lua script not found: %s\n", script_files[i]);
+			return FALSE;
+		}
+	}
 
-	if (Lua_State)
+	script = CompileLuaPipeline(script_files, scriptStageCount);
+	if (script)
 	{
-		lua_close(Lua_State);
+		PublishLuaScript(script);
+		return TRUE;
 	}
 
-	// each time we call this function, we create a new environment
-	// this is so that we can have a script loaded... then change it, and reload our changes
-	Lua_State = luaL_newstate();
-	luaL_openlibs(Lua_State);
+	if (LuaScriptIsLoaded())
+		printf("keeping previously loaded script\n");
+	return FALSE;
+}
+
+// asks for a script name, and turns it into a path in the scripts directory
+// returns FALSE if nothing was entered
+bool AskForScriptFile(const char *prompt, char *filename)
+{
+
+	char tmp[200];
+	char ext[] = ".lua";
 
-	printf("Enter lua script: ");
+	printf("%s", prompt);
 
-	if (scanf("%s", tmp) == 1)
+	if (scanf("%199s", tmp) == 1)
 	{
 
-		strcpy(script_file, SCRIPT_LOCATION);
-		strcat(script_file, tmp);
+		strcpy(filename, SCRIPT_LOCATION);
+		strcat(filename, tmp);
 
 		// tack on the extension if none is present
-		if (!strchr(script_file, '.'))
-			strcat(script_file, ext);
+		if (!strchr(filename, '.'))
+			strcat(filename, ext);
 
-		if (fileexists(script_file))
-		{
-			script_is_loaded = (luaL_dofile(Lua_State, script_file) == 0);
-			if (!script_is_loaded)
-			{
-				printf("%s\n", lua_tostring(Lua_State, -1));
-			}
-		}
-		else
-			printf("lua script not found: %s\n", script_file);
+		return TRUE;
 	}
+
+	return FALSE;
 }
 
-// resets the LUA state, and reloads [restarts] the last script we had loaded
-void ReLoadLuaScript()
+// replaces the whole pipeline with just the one script
+void LoadLuaScript()
 {
+	char filename[255];
 
-	if (Lua_State)
+	if (AskForScriptFile("Enter lua script: ", filename))
 	{
-		lua_close(Lua_State);
+		pthread_mutex_lock(&scriptFilesLock);
+		strcpy(script_files[0], filename);
+		scriptStageCount = 1;
+		SwapInLuaPipeline();
+		pthread_mutex_unlock(&scriptFilesLock);
 	}
+}
+
+// adds a script to the end of the pipeline, so it gets whatever the scripts before it put out
+// if the new pipeline doesn't load, the stage isn't added (so it can't break later reloads)
+void AddLuaStage()
+{
+	char filename[255];
 
-	// each time we call this function, we create a new environment
-	// this is so that we can have a script loaded... then change it, and reload our changes
-	Lua_State = luaL_newstate();
-	luaL_openlibs(Lua_State);
+	if (scriptStageCount == MAX_LUA_STAGES)
+	{
+		printf("the pipeline already has %d stages\n", MAX_LUA_STAGES);
+		return;
+	}
 
-	if (fileexists(script_file))
+	if (AskForScriptFile("Enter lua script to add: ", filename))
 	{
-		script_is_loaded = (luaL_dofile(Lua_State, script_file) == 0);
-		if (!script_is_loaded)
+		pthread_mutex_lock(&scriptFilesLock);
+		strcpy(script_files[scriptStageCount], filename);
+		scriptStageCount++;
+		if (!SwapInLuaPipeline())
 		{
-			printf("error in .Lua script: %s\n", lua_tostring(Lua_State, -1));
+			scriptStageCount--;
+			printf("not adding %s to the pipeline\n", filename);
 		}
+		pthread_mutex_unlock(&scriptFilesLock);
 	}
-	else
-		printf("error loading lau script %s\n", script_file);
 }
 
-void *CheckOnFile(void *arg)
+// observer scripts run on their own (ordinary priority) thread, and just get a copy of every event
+void LoadObserver()
+{
+	char filename[255];
+
+	if (AskForScriptFile("Enter observer script: ", filename))
+	{
+		if (!fileexists(filename))
+			printf("lua script not found: %s\n", filename);
+		else if (LoadObserverScript(filename))
+			printf("observer script loaded\n");
+	}
+}
+
+// resets the LUA state, and reloads [restarts] the last scripts we had loaded
+void ReLoadLuaScript()
+{
+	pthread_mutex_lock(&scriptFilesLock);
+	if (scriptStageCount > 0)
+		SwapInLuaPipeline();
+	pthread_mutex_unlock(&scriptFilesLock);
+}
+
+// old way of noticing script changes: stat() the file every 5 seconds
+// only used if inotify isn't available for some reason (and only watches the first stage)
+void *PollScriptFile()
 {
 	while (1)
 	{
-		if (script_is_loaded)
-			if (ShouldReloadFile(script_file))
+		if (LuaScriptIsLoaded())
+		{
+			char filename[255];
+
+			pthread_mutex_lock(&scriptFilesLock);
+			strcpy(filename, script_files[0]);
+			pthread_mutex_unlock(&scriptFilesLock);
+
+			if (ShouldReloadFile(filename))
 			{
 				printf("script modified...\n");
 				ReLoadLuaScript();
 			}
+		}
 
 		sleep(5);
 	}
 }
 
+// watches the scripts directory, and reloads the current script as soon as it is written out
+// editors often write a file several times in a row when saving, so we wait until things have been
+// quiet for RELOAD_DEBOUNCE_MS before actually reloading, which gives us a single reload per save
+void *CheckOnFile(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fd;
+	bool pending = FALSE;
+
+	fd.fd = inotify_init1(IN_CLOEXEC);
+	fd.events = POLLIN;
+	if (fd.fd < 0 || inotify_add_watch(fd.fd, SCRIPT_LOCATION, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		perror("inotify");
+		printf("falling back to checking for script changes every 5 seconds\n");
+		return PollScriptFile();
+	}
+
+	while (1)
+	{
+		int result = poll(&fd, 1, pending ? RELOAD_DEBOUNCE_MS : -1);
+
+		if (result == 0)
+		{
+			// things have settled down since the last write
+			printf("script modified...\n");
+			ReLoadLuaScript();
+			pending = FALSE;
+			continue;
+		}
+
+		if (result < 0)
+			continue;
+
+		int len = read(fd.fd, buf, sizeof(buf));
+		for (char *p = buf; p < buf + len;)
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			// we only care about the scripts we currently have loaded (even if they failed to load,
+			// since the write we just saw might be the fix for that)
+			pthread_mutex_lock(&scriptFilesLock);
+			for (int i = 0; i < scriptStageCount && event->len; i++)
+				if (strcmp(event->name, script_files[i] + strlen(SCRIPT_LOCATION)) == 0)
+					pending = TRUE;
+			pthread_mutex_unlock(&scriptFilesLock);
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
 void *MainThread(void *arg)
 {
 	int len;
@@ -1100,7 +2058,9 @@ void *MainThread(void *arg)
 
 		if (strcmp(line, "5") == 0)
 		{
-			DoNextTranspositionMode();
+			enum transpositionModes mode = NextTranspositionMode(transpositionMode);
+			set_transposition_mode(mode);
+			printf("%s", transpositionModeNames[mode]);
 		}
 
 		if (strcmp(line, "6") == 0)
@@ -1111,11 +2071,11 @@ void *MainThread(void *arg)
 		if (strcmp(line, "7") == 0)
 		{
 			printf("Enter bpm: ");
-			int n;
-			if (scanf("%d", &n) == 1)
+			double n;
+			if (scanf("%lf", &n) == 1 && n > 0)
 			{
-				setBeatsPerMinute(n); // this will reinitialize the timer for the metronome to the right frequency for us...
-				printf("bmp set to %d\n", n);
+				setBeatsPerMinute(n); // takes effect from the next bar
+				printf("bmp set to %.2f\n", n);
 			}
 		}
 
@@ -1185,6 +2145,7 @@ void *MainThread(void *arg)
 			if (scanf("%d", &n) == 1)
 			{
 				NoteOffset = n;
+				UpdateNoteMaps();
 				printf("noteoffset set to %d\n", n);
 			}
 		}
@@ -1196,11 +2157,7 @@ void *MainThread(void *arg)
 
 		if (strcmp(line, "12") == 0)
 		{
-			if (Lua_State)
-			{
-				lua_close(Lua_State);
-				Lua_State = 0;
-			}
+			PublishLuaScript(NULL);
 		}
 
 		if (strcmp(line, "13") == 0)
@@ -1209,6 +2166,127 @@ void *MainThread(void *arg)
 			isFirstTime = true;
 		}
 
+		if (strcmp(line, "14") == 0)
+		{
+			ShowEventStatistics();
+		}
+
+		if (strcmp(line, "15") == 0)
+		{
+			ShowLatency();
+		}
+
+		if (strcmp(line, "16") == 0)
+		{
+			ShowLuaMemoryStatistics();
+		}
+
+		if (strcmp(line, "17") == 0)
+		{
+			LoadObserver();
+		}
+
+		if (strcmp(line, "18") == 0)
+		{
+			UnloadObserverScript();
+			printf("observer script unloaded\n");
+		}
+
+		if (strcmp(line, "19") == 0)
+		{
+			AddLuaStage();
+		}
+
+		if (strcmp(line, "20") == 0)
+		{
+			ShowLuaPipelineStatistics();
+		}
+
+		if (strcmp(line, "21") == 0)
+		{
+			ShowMetronomeStatistics();
+		}
+
+		if (strcmp(line, "22") == 0)
+		{
+			printf("\nSubdivisions:\n"
+				   " 1 [enter] just the beats \n"
+				   " 2 [enter] eighths \n"
+				   " 3 [enter] triplets \n"
+				   " 4 [enter] sixteenths \n");
+
+			int clicks;
+			double swingRatio = 0.5;
+			if (scanf("%d", &clicks) == 1)
+			{
+				if (clicks == 2 || clicks == 4)
+				{
+					printf("Enter swing (0.5 = straight, 0.67 = triplet swing): ");
+					if (scanf("%lf", &swingRatio) != 1)
+						swingRatio = 0.5;
+				}
+				setSubdivisions(clicks, swingRatio);
+				printf("%d clicks per beat, swing %.2f\n", getSubdivisions(), getSwing());
+			}
+		}
+
+		if (strcmp(line, "23") == 0)
+		{
+			printf("Change tempo by how many bpm (e.g. 2, or -2): ");
+			double step;
+			int bars;
+			if (scanf("%lf", &step) == 1)
+			{
+				printf("Every how many bars (0 = fixed tempo): ");
+				if (scanf("%d", &bars) == 1)
+				{
+					setTempoMap(step, bars);
+					if (bars > 0)
+						printf("tempo changes by %+.2f bpm every %d bars%s\n", step, bars,
+							   getTempoFollow() ? " (once the metronome stops following you)" : "");
+					else
+						printf("fixed tempo\n");
+				}
+			}
+		}
+
+		if (strcmp(line, "24") == 0)
+		{
+			ShowTempoTracking();
+		}
+
+		if (strcmp(line, "25") == 0)
+		{
+			setTempoFollow(!getTempoFollow());
+			printf("metronome %s your tempo\n", getTempoFollow() ? "follows (tempo map off)" : "no longer follows");
+		}
+
+		if (strcmp(line, "26") == 0)
+		{
+			printf("\nMIDI clock:\n"
+				   " 0 [enter] off \n"
+				   " 1 [enter] send clock (and start\\stop) with the metronome \n"
+				   " 2 [enter] follow incoming clock \n");
+
+			int mode;
+			if (scanf("%d", &mode) == 1 && mode >= CLOCK_OFF && mode <= CLOCK_SLAVE)
+			{
+				CommandMessage msg;
+				int seq;
+
+				msg.cmdCode = CMD_SET_CLOCK_MODE;
+				msg.Param2 = mode;
+				seq = SendCallbackCommand(&msg);
+				if (!WaitForAck(seq, ACK_TIMEOUT_MS))
+					printf("MIDI callback did not acknowledge clock mode change\n");
+
+				// if the metronome is running, it starts over (so a start message goes out in front of the next bar)
+				if (metronome_enabled)
+					EnableMetronome();
+				printf("%s\n", mode == CLOCK_OFF ? "MIDI clock off" : mode == CLOCK_MASTER ? "sending MIDI clock" : "following MIDI clock");
+			}
+		}
+
 		ShowCommands();
 	} // while (!finished)
 }
@@ -1221,6 +2299,7 @@ void SetUpInitialVoices()
 
 	uint8_t program_change[2] = {0xC0, 10};
 
+	buffer.timestamp = NowForOutput();
 	buffer.message = Pm_Message(194, 6, 0);
 	err = Pm_Write(midi_out, &buffer, 1);
 
@@ -1307,6 +2386,7 @@ int main(int argc, char *argv[])
 #endif
 
 	initialize();
+	ShowRealTimeReport();
 
 	printf("no tranposition active\n");
 
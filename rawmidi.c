@@ -0,0 +1,138 @@
+//
+// RawMidi.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Reads MIDI directly from a raw MIDI device file (e.g. /dev/snd/midiC1D0) instead of going
+// through portmidi. Because it is just a file descriptor, the caller can block in poll() until
+// the piano actually sends something, instead of polling portmidi every millisecond.
+//
+// The bytes coming from the device are turned back into portmidi style PmEvents, so the rest of
+// the program doesn't care where they came from. Like the portmidi input we normally open, active
+// sensing and clock messages are filtered out (clock is kept if keepClock is set); sysex is skipped entirely.
+//
+// Usage:
+//	fd = RawMidiOpen("/dev/snd/midiC1D0");
+//	RawMidiReset(&parser);
+//	n = read(fd, bytes, sizeof(bytes));
+//	count = RawMidiParse(&parser, bytes, n, events, Pt_Time());	// events needs room for n entries
+//
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rawmidi.h"
+
+// returns the number of data bytes that follow the given status byte
+int DataBytesForStatus(int status)
+{
+	switch (status & 0xF0)
+	{
+	case 0xC0: // program change
+	case 0xD0: // channel pressure
+		return 1;
+	case 0xF0:
+		switch (status)
+		{
+		case 0xF1: // time code quarter frame
+		case 0xF3: // song select
+			return 1;
+		case 0xF2: // song position
+			return 2;
+		default:
+			return 0;
+		}
+	default:
+		return 2;
+	}
+}
+
+// opens the device for non-blocking reads; returns -1 on failure
+int RawMidiOpen(const char *device)
+{
+	int fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		perror(device);
+	return fd;
+}
+
+void RawMidiClose(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+void RawMidiReset(RawMidiParser *parser)
+{
+	parser->status = 0;
+	parser->dataCount = 0;
+	parser->inSysex = 0;
+	parser->keepClock = 0;
+}
+
+// turns length bytes into complete events; partial messages are remembered for the next call
+// returns the number of events written (never more than length)
+int RawMidiParse(RawMidiParser *parser, const unsigned char *bytes, int length, PmEvent *events, PmTimestamp now)
+{
+	int count = 0;
+
+	for (int i = 0; i < length; i++)
+	{
+		int b = bytes[i];
+
+		if (b >= 0xF8)
+		{
+			// real-time messages can show up anywhere, and don't disturb running status
+			if ((b != 0xF8 || parser->keepClock) && b != 0xFE)
+			{
+				events[count].message = Pm_Message(b, 0, 0);
+				events[count].timestamp = now;
+				count++;
+			}
+			continue;
+		}
+
+		if (b & 0x80)
+		{
+			// a new status byte; this also terminates any sysex we were skipping
+			parser->inSysex = (b == 0xF0);
+			parser->status = (b >= 0xF0) ? 0 : b; // system messages cancel running status
+			parser->dataCount = 0;
+
+			if (b > 0xF0 && b != 0xF7)
+			{
+				if (DataBytesForStatus(b) == 0)
+				{
+					events[count].message = Pm_Message(b, 0, 0);
+					events[count].timestamp = now;
+					count++;
+				}
+				else
+					parser->status = b;
+			}
+			continue;
+		}
+
+		// a data byte
+		if (parser->inSysex || parser->status == 0)
+			continue;
+
+		parser->data[parser->dataCount++] = b;
+
+		if (parser->dataCount == DataBytesForStatus(parser->status))
+		{
+			events[count].message = Pm_Message(parser->status, parser->data[0], parser->dataCount == 2 ? parser->data[1] : 0);
+			events[count].timestamp = now;
+			count++;
+
+			parser->dataCount = 0;
+
+			// system common messages don't set up running status
+			if (parser->status >= 0xF0)
+				parser->status = 0;
+		}
+	}
+
+	return count;
+}
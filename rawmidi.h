@@ -0,0 +1,18 @@
+#pragma once
+
+#include "portmidi/portmidi.h"
+
+// state needed to turn a raw MIDI byte stream back into complete messages
+typedef struct
+{
+	int status;		 // current running status, or 0 if we don't have one
+	int data[2];	 // data bytes received so far for the current message
+	int dataCount;	 // how many data bytes we have
+	int inSysex;	 // TRUE while we are skipping over a sysex message
+	int keepClock;	 // TRUE to pass MIDI clock (0xF8) through, instead of throwing it away
+} RawMidiParser;
+
+int RawMidiOpen(const char *device);
+void RawMidiClose(int fd);
+void RawMidiReset(RawMidiParser *parser);
+int RawMidiParse(RawMidiParser *parser, const unsigned char *bytes, int length, PmEvent *events, PmTimestamp now);
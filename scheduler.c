@@ -0,0 +1,137 @@
+//
+// Scheduler.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Events to be sent some time in the future (echoes, delayed chords, note-offs for notes a script made
+// up, ...). They are kept in a fixed size binary heap ordered by their portmidi time, which the MIDI
+// thread checks every tick, sending anything that has come due.
+//
+// Events scheduled for the same time go out in the order they were scheduled.
+// Nothing here is locked: only the MIDI thread may use it (lua scripts run on the MIDI thread too).
+//
+// Usage:
+//	ScheduleEvent(Pt_Time() + 500, Pm_Message(144, 60, 100));
+//	...
+//	count = TakeDueEvents(Pt_Time(), events, MAX_EVENTS);		// once per tick
+//
+
+#include "scheduler.h"
+
+#define SCHEDULER_CAPACITY 1024
+
+typedef struct
+{
+	PmTimestamp when;
+	unsigned int sequence; // breaks ties, so events due at the same time keep their order
+	PmMessage message;
+} ScheduledEvent;
+
+ScheduledEvent heap[SCHEDULER_CAPACITY];
+int heapCount;
+unsigned int nextSequence;
+unsigned long overflows;
+
+// private routines
+bool Earlier(const ScheduledEvent *a, const ScheduledEvent *b);
+void SiftUp(int i);
+void SiftDown(int i);
+
+bool Earlier(const ScheduledEvent *a, const ScheduledEvent *b)
+{
+	if (a->when != b->when)
+		return (a->when - b->when) < 0;
+	return (int)(a->sequence - b->sequence) < 0;
+}
+
+void SiftUp(int i)
+{
+	ScheduledEvent e = heap[i];
+
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if (!Earlier(&e, &heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+
+	heap[i] = e;
+}
+
+void SiftDown(int i)
+{
+	ScheduledEvent e = heap[i];
+
+	while (1)
+	{
+		int child = i * 2 + 1;
+		if (child >= heapCount)
+			break;
+		if (child + 1 < heapCount && Earlier(&heap[child + 1], &heap[child]))
+			child++;
+		if (!Earlier(&heap[child], &e))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = e;
+}
+
+// returns false (and counts it) if the queue is full
+bool ScheduleEvent(PmTimestamp when, PmMessage message)
+{
+	if (heapCount == SCHEDULER_CAPACITY)
+	{
+		overflows++;
+		return false;
+	}
+
+	heap[heapCount].when = when;
+	heap[heapCount].sequence = nextSequence++;
+	heap[heapCount].message = message;
+	SiftUp(heapCount++);
+
+	return true;
+}
+
+// removes up to maxCount events that are due at or before now, in order, and returns how many
+int TakeDueEvents(PmTimestamp now, PmEvent *events, int maxCount)
+{
+	int count = 0;
+
+	while (count < maxCount && heapCount > 0 && (heap[0].when - now) <= 0)
+	{
+		events[count].message = heap[0].message;
+		events[count].timestamp = heap[0].when;
+		count++;
+
+		heap[0] = heap[--heapCount];
+		if (heapCount > 0)
+			SiftDown(0);
+	}
+
+	return count;
+}
+
+// tells the caller when the next event is due; returns false if nothing is scheduled
+bool NextScheduledTime(PmTimestamp *when)
+{
+	if (heapCount == 0)
+		return false;
+
+	*when = heap[0].when;
+	return true;
+}
+
+int ScheduledEventCount()
+{
+	return heapCount;
+}
+
+unsigned long SchedulerOverflowCount()
+{
+	return overflows;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "portmidi/portmidi.h"
+
+// only ever call these from the MIDI thread
+bool ScheduleEvent(PmTimestamp when, PmMessage message);
+int TakeDueEvents(PmTimestamp now, PmEvent *events, int maxCount);
+bool NextScheduledTime(PmTimestamp *when);
+int ScheduledEventCount();
+unsigned long SchedulerOverflowCount();
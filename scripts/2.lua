@@ -0,0 +1,18 @@
+-- example of process_midi_batch: gets every event from one callback tick at once
+-- events is a flat table {status, data1, data2, status, data1, data2, ...}
+-- and n is how many events are in it. return a table laid out the same way.
+function process_midi_batch(events, n)
+
+    -- soften everything a little; note-offs (status 128) are left alone
+    for i = 0, n - 1 do
+        local status = events[i * 3 + 1]
+        local velocity = events[i * 3 + 3]
+        if (status ~= 128 and velocity > 0) then
+            events[i * 3 + 3] = math.max(1, velocity - 20)
+        end
+    end
+
+    return events
+  end
+
+  print("example batch script: everything 20 velocity units softer");
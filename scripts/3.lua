@@ -0,0 +1,16 @@
+-- example of a pure script: process_midi only looks at its arguments (no globals, no printing),
+-- and hands data2 back unchanged, so the host can call it for every possible status and data1
+-- when the script loads, and never call into lua again while we are playing
+process_midi_pure = true
+
+function process_midi(status, data1, data2)
+
+    -- move notes up an octave, as long as they stay on the keyboard
+    if (status >= 128 and status < 160 and data1 + 12 <= 127) then
+        return status, data1 + 12, data2;
+    end
+
+    return status, data1, data2;
+  end
+
+  print("example pure script: everything up an octave");
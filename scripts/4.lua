@@ -0,0 +1,21 @@
+-- example of process_midi_buffer: buf is every event from one callback tick, shared with the host
+-- (nothing is copied). #buf is the number of events; for each event i (counting from 1):
+--   buf:status(i), buf:data1(i), buf:data2(i), buf:timestamp(i)
+--   status, data1, data2 = buf:get(i)
+--   buf:set(i, status, data1, data2)
+-- buf:setcount(n) drops events off the end, or makes room to add new ones
+function process_midi_buffer(buf)
+
+    -- double every note an octave down
+    local n = #buf
+    for i = 1, n do
+        local status, data1, data2 = buf:get(i)
+        if (status >= 128 and status < 160 and data1 >= 12) then
+            local added = #buf + 1
+            buf:setcount(added)
+            buf:set(added, status, data1 - 12, data2)
+        end
+    end
+  end
+
+  print("example buffer script: notes doubled an octave down");
@@ -0,0 +1,23 @@
+-- example of emit_at: every note is echoed back twice, quieter each time
+-- emit_at(ms, status, data1, data2) sends a message later on; ms is an absolute time, on the same
+-- clock as now(). it can only be called from inside process_midi (or the batch/buffer versions)
+echo_delay = 250
+
+function process_midi(status, data1, data2)
+
+    -- note on/off on any channel
+    if (status >= 128 and status < 160) then
+        local t = now()
+        if (status >= 144 and data2 > 0) then
+            emit_at(t + echo_delay, status, data1, data2 // 2)
+            emit_at(t + echo_delay * 2, status, data1, data2 // 4)
+        else
+            emit_at(t + echo_delay, status, data1, data2)
+            emit_at(t + echo_delay * 2, status, data1, data2)
+        end
+    end
+
+    return status, data1, data2
+  end
+
+  print("example echo script: notes repeat " .. echo_delay .. "ms apart");
@@ -0,0 +1,14 @@
+-- example observer script (load it with command 17): it runs on its own thread, gets a copy of
+-- every incoming event, and can't change what gets played
+notes_played = 0
+
+function observe_midi(status, data1, data2, timestamp)
+    if (status >= 144 and status < 160 and data2 > 0) then
+        notes_played = notes_played + 1
+        if (notes_played % 100 == 0) then
+            print(notes_played .. " notes played (at " .. timestamp .. " ms)");
+        end
+    end
+  end
+
+  print("example observer: counts notes");
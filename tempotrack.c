@@ -0,0 +1,134 @@
+//
+// TempoTrack.c
+//
+// Benjamin Pritchard / Kundalini Software
+//
+// Works out the tempo the player is actually playing at, from the time between their note-ons.
+//
+// Every note-on costs the same small, fixed amount of work (so this can run in the MIDI callback):
+// notes closer together than MIN_ONSET_GAP_MS are treated as one onset (chords, rolled chords),
+// each gap between onsets is folded by octaves into the range around the current beat estimate
+// (so eighths and half notes still count towards the same beat), and the estimate follows the
+// folded gaps with an exponential moving average. A long enough pause starts everything over.
+//
+// Usage:
+//	(callback, for each note-on)
+//	TrackOnset(event.timestamp);
+//
+//	(any thread)
+//	bpm = TrackedTempo();		// 0 until we have heard enough notes
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "tempotrack.h"
+
+#define MIN_ONSET_GAP_MS 70	   // note-ons closer together than this are part of the same onset
+#define MAX_ONSET_GAP_MS 2000  // a gap longer than this means the player stopped
+#define MIN_BEAT_MS 300.0	   // 200 bpm
+#define MAX_BEAT_MS 1000.0	   // 60 bpm
+#define TEMPO_SMOOTHING 0.2	   // how much each new gap moves the estimate
+#define MIN_TRACKED_ONSETS 4   // gaps we need to have seen before we trust the estimate
+
+// only touched by the MIDI thread
+PmTimestamp lastOnset;
+bool haveOnset = false;
+double beatMs = 0;	  // current estimate of the length of a beat; 0 means we don't have one yet
+double unsteadiness;  // moving average of how far each gap was from the estimate (as a fraction of a beat)
+int trackedOnsets;	  // gaps that have gone into the current estimate
+
+// what everyone else gets to see
+_Atomic double trackedTempo;
+_Atomic double trackedUnsteadiness;
+atomic_ulong totalOnsets;
+
+// feeds one note-on into the estimate; returns TRUE if it changed the estimate
+bool TrackOnset(PmTimestamp when)
+{
+	double gap, error;
+
+	atomic_fetch_add_explicit(&totalOnsets, 1, memory_order_relaxed);
+
+	if (!haveOnset)
+	{
+		lastOnset = when;
+		haveOnset = true;
+		return false;
+	}
+
+	gap = when - lastOnset;
+	if (gap < MIN_ONSET_GAP_MS)
+		return false; // another note of the same chord; the onset is when the first one started
+
+	lastOnset = when;
+
+	if (gap > MAX_ONSET_GAP_MS)
+	{
+		// the player stopped; start over
+		beatMs = 0;
+		trackedOnsets = 0;
+		atomic_store(&trackedTempo, 0);
+		return true;
+	}
+
+	if (beatMs == 0)
+	{
+		// first gap: assume it is a beat somewhere between 60 and 200 bpm
+		while (gap < MIN_BEAT_MS)
+			gap *= 2;
+		while (gap >= MAX_BEAT_MS)
+			gap /= 2;
+
+		beatMs = gap;
+		unsteadiness = 0;
+		trackedOnsets = 1;
+		return false;
+	}
+
+	// fold the gap into [0.7, 1.4) beats, so a note every half beat (or every two beats) agrees with a note every beat
+	// (the gap and the estimate are both bounded, so these loops only go around a few times)
+	while (gap < beatMs * 0.7)
+		gap *= 2;
+	while (gap >= beatMs * 1.4)
+		gap /= 2;
+
+	error = (gap - beatMs) / beatMs;
+	unsteadiness += TEMPO_SMOOTHING * ((error < 0 ? -error : error) - unsteadiness);
+	beatMs += TEMPO_SMOOTHING * (gap - beatMs);
+
+	if (beatMs < MIN_BEAT_MS)
+		beatMs = MIN_BEAT_MS;
+	if (beatMs > MAX_BEAT_MS)
+		beatMs = MAX_BEAT_MS;
+
+	if (++trackedOnsets < MIN_TRACKED_ONSETS)
+		return false;
+
+	atomic_store(&trackedTempo, 60000.0 / beatMs);
+	atomic_store(&trackedUnsteadiness, unsteadiness);
+	return true;
+}
+
+// the player's tempo in bpm, or 0 if we haven't heard enough to say
+double TrackedTempo()
+{
+	return atomic_load(&trackedTempo);
+}
+
+void ShowTempoTracking()
+{
+	double tempo = atomic_load(&trackedTempo);
+
+	printf("note-ons heard:             %lu\n", atomic_load(&totalOnsets));
+
+	if (tempo == 0)
+	{
+		printf("not enough notes to tell the tempo yet\n");
+		return;
+	}
+
+	printf("player's tempo:             %.1f bpm\n", tempo);
+	printf("unsteadiness:               %.1f%% of a beat\n", atomic_load(&trackedUnsteadiness) * 100);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "portmidi/portmidi.h"
+
+// only call this from the MIDI thread
+bool TrackOnset(PmTimestamp when);
+
+// these can be called from any thread
+double TrackedTempo();
+void ShowTempoTracking();